@@ -7,7 +7,14 @@
  */
 
 #include <iostream>                 // for cout, ostream
+#include <algorithm>                // for find, remove
+#include <atomic>                   // for atomic
+#include <exception>                // for exception_ptr
+#include <set>                      // for set
+#include <thread>                   // for thread
 #include <atl/compile.hpp>              // for Compile
+#include <atl/expression_cache.hpp>     // for ExpressionCache
+#include <atl/helpers/bounded_queue.hpp> // for BoundedQueue
 #include <atl/lexical_environment.hpp>  // for AssignForms, AssignFree, BackPatch
 #include <atl/parser.hpp>               // for ParseString
 #include <atl/type.hpp>                 // for init_types, Any, LAST_CONCRETE_TYPE
@@ -39,6 +46,15 @@ namespace atl
 
 		std::ostream* stdout;
 
+		// Slots of the top level definitions, in the order they were
+		// made.
+		std::vector<size_t> definition_order;
+
+		// Bumped whenever a slot's definition changes, so cached
+		// code which used the old definition can tell.
+		std::vector<size_t> slot_versions;
+		ExpressionCache expression_cache;
+
 		Atl() :
 			slots(gc)
 			, lexical(gc, slots)
@@ -46,12 +62,19 @@ namespace atl
 			, new_types(LAST_CONCRETE_TYPE)
 			, gamma(gc, new_types)
 			, w(gc, new_types, gamma)
-			, compiler(gc)
+			, compiler(gc, &slots)
 			, vm(gc)
+			, expression_cache(gc)
 		{
 			init_types();
 			setup_basic_definitions(gc, lexical);
 			stdout = &std::cout;
+
+			vm.compile_lazily = [this](LambdaMetadata* metadata, pcode::Offset stub)
+				{
+					GC::DeferGC defer(gc);
+					return compiler.compile_lazy_body(*metadata, stub);
+				};
 		}
 
 		/**
@@ -61,12 +84,52 @@ namespace atl
 		 */
 		Any annotate(Ast& expr)
 		{
-			expr = *assign_forms(expr);
-
-			auto type_info = w.W(expr);
-			inference::apply_substitution(gc, type_info.subs, ref_wrap(expr));
+			// AssignForms installs a definition in its slot straight
+			// away; a redefinition which then fails to type check
+			// mustn't replace the old one.
+			// The walkers hold raw pointers into `expr`
+			GC::DeferGC defer(gc);
+
+			auto redefined = _redefined_slot(expr);
+			Any previous;
+			if(redefined != Compile::no_slot)
+				{ previous = slots[redefined]; }
+
+			try
+				{
+					expr = *assign_forms(expr);
+
+					auto type_info = w.W(expr);
+					inference::apply_substitution(gc, type_info.subs, ref_wrap(expr));
+
+					return *type_info.type;
+				}
+			catch(...)
+				{
+					if(redefined != Compile::no_slot)
+						{ slots[redefined] = previous; }
+					throw;
+				}
+		}
 
-			return *type_info.type;
+		/// \internal If `expr` is an unannotated definition of a name
+		/// which already has one, the slot it's defined in.
+		size_t _redefined_slot(Ast& expr)
+		{
+			if(expr.size() != 3
+			   || !is<Symbol>(expr[0]) || unwrap<Symbol>(expr[0]).name != "define"
+			   || !is<Symbol>(expr[1]))
+				{ return Compile::no_slot; }
+
+			auto found = lexical.local.find(unwrap<Symbol>(expr[1]).name);
+			if(found == lexical.local.end() || !is<GlobalSlot>(found->second))
+				{ return Compile::no_slot; }
+
+			// Symbols used before they're defined get a slot too
+			auto slot = unwrap<GlobalSlot>(found->second).value;
+			if(!is<Ast>(slots[slot]))
+				{ return Compile::no_slot; }
+			return slot;
 		}
 
 		void compile(Ast& expr)
@@ -90,8 +153,226 @@ namespace atl
 		void compile(ast_composer const& compose)
 		{ compile(gc(compose)); }
 
+		/** Keep the compiler from inlining calls to the function
+		 * `name` in code compiled from here on.
+		 */
+		void noinline(std::string const& name)
+		{
+			auto found = lexical.local.find(name);
+			Any lambda;
+
+			if(found == lexical.local.end()
+			   || !is<GlobalSlot>(found->second)
+			   || !compiler._known_lambda(unwrap<GlobalSlot>(found->second).value, lambda))
+				{ throw WrongTypeError(name + " isn't a defined function"); }
+
+			unwrap<Lambda>(*subex(lambda).begin()).value->noinline = true;
+		}
+
+		/// \internal Note that the define `ast` has been compiled.
+		void _record_definition(Ast& ast)
+		{
+			auto slot = unwrap<Symbol>(ast[1]).slot;
+			definition_order.erase(std::remove(definition_order.begin(), definition_order.end(), slot),
+			                       definition_order.end());
+			definition_order.push_back(slot);
+			_bump_version(slot);
+		}
+
+		/** Compile the annotated definition `ast`.  If it replaces an
+		 * earlier definition, the definitions whose code was
+		 * compiled from that one (see Compile::dependencies) get
+		 * recompiled after it, as do any values computed at the top
+		 * level which could call it.  Other code reaches the new
+		 * definition through its slot.
+		 */
+		void _compile_definition(Ast& ast)
+		{
+			GC::DeferGC defer(gc);
+			auto slot = unwrap<Symbol>(ast[1]).slot;
+			bool redefining = std::find(definition_order.begin(), definition_order.end(), slot)
+				!= definition_order.end();
+
+			compiler.compile(ast);
+			_record_definition(ast);
+
+			if(!redefining)
+				{ return; }
+
+			std::set<size_t> changed{slot};
+			for(bool grew = true; grew;)
+				{
+					grew = false;
+					for(auto def : definition_order)
+						{
+							if(changed.count(def))
+								{ continue; }
+
+							Any lambda;
+							bool stale = compiler.depends_on(def, changed);
+							if(!stale && !compiler._known_lambda(def, lambda))
+								{
+									auto reachable = _reachable({def});
+									for(auto used : changed)
+										{ stale |= used < reachable.size() && reachable[used]; }
+								}
+
+							if(stale)
+								{
+									changed.insert(def);
+									grew = true;
+								}
+						}
+				}
+
+			// Copies specialized from the old definitions are stale too
+			compiler._specializations.clear();
+
+			auto order = definition_order;
+			for(auto def : order)
+				{
+					if(def == slot || !changed.count(def))
+						{ continue; }
+
+					auto& dependent = unwrap<Ast>(slots[def]);
+					compiler.compile(dependent);
+					_record_definition(dependent);
+				}
+		}
+
+		void _bump_version(size_t slot)
+		{
+			if(slot >= slot_versions.size())
+				{ slot_versions.resize(slot + 1, 0); }
+			++slot_versions[slot];
+		}
+
+		size_t _slot_version(size_t slot) const
+		{ return slot < slot_versions.size() ? slot_versions[slot] : 0; }
+
+		/// \internal Slots reachable through the global Symbols
+		/// (including quoted ones) of the definitions in `pending`.
+		std::vector<bool> _reachable(std::vector<size_t> pending)
+		{
+			std::vector<bool> reachable(slots.size(), false);
+
+			while(!pending.empty())
+				{
+					auto slot = pending.back();
+					pending.pop_back();
+
+					if(slot >= slots.size() || reachable[slot])
+						{ continue; }
+					reachable[slot] = true;
+
+					if(!is<Ast>(slots[slot]))
+						{ continue; }
+
+					for(auto used : _used_slots(unwrap<Ast>(slots[slot])))
+						{
+							if(used < slots.size() && !reachable[used])
+								{ pending.push_back(used); }
+						}
+				}
+			return reachable;
+		}
+
+		static std::vector<size_t> _used_slots(Ast& ast)
+		{
+			std::vector<size_t> used;
+			for(auto itr = ast.flat_begin(); itr != ast.flat_end(); ++itr)
+				{
+					if(itr->_tag == tag<Symbol>::value)
+						{ used.push_back(unwrap<Symbol>(*itr).slot); }
+				}
+			return used;
+		}
+
+		/// \internal Could computing the value of the definition in
+		/// `slot` have side effects?  Lambdas just make a closure.
+		bool _side_effecting(size_t slot)
+		{
+			auto def = subex(slots[slot]);
+			if(def.size() != 3)
+				{ return true; }
+
+			auto value = *(def.begin() + 2);
+			if(is<Ast>(value) && subex(value).begin().tag() == tag<Lambda>::value)
+				{ return false; }
+			return !compiler._pure(value);
+		}
+
+		/** Drop the top level definitions which can't be reached from
+		 * `entry` and recompile the rest, so the code only holds what
+		 * `entry` needs.  Reachability follows the global Symbols
+		 * (including quoted ones) in each definition.  Definitions
+		 * whose values could have side effects are kept, along with
+		 * what they reach.  Dropped names lose their type schemes and
+		 * become undefined.
+		 *
+		 * @param entry: name of the root definition
+		 * @return: the number of definitions dropped
+		 */
+		size_t tree_shake(std::string const& entry="main")
+		{
+			auto found = lexical.local.find(entry);
+			if(found == lexical.local.end() || !is<GlobalSlot>(found->second))
+				{ throw WrongTypeError(entry + " isn't defined"); }
+
+			std::vector<size_t> roots{unwrap<GlobalSlot>(found->second).value};
+			for(auto slot : definition_order)
+				{
+					if(_side_effecting(slot))
+						{ roots.push_back(slot); }
+				}
+			auto reachable = _reachable(roots);
+
+			// Forget the unreachable names
+			std::vector<std::string> dropped;
+			for(auto& item : lexical.local)
+				{
+					if(is<GlobalSlot>(item.second)
+					   && !reachable[unwrap<GlobalSlot>(item.second).value])
+						{ dropped.push_back(item.first); }
+				}
+			for(auto& name : dropped)
+				{
+					lexical.local.erase(name);
+					gamma.symbols.erase(name);
+				}
+
+			// Recompile what's left, in the original order
+			std::vector<size_t> kept;
+			compiler.truncate(0);
+			compiler.code_store.num_slots = 0;
+			expression_cache.clear();
+
+			// Whatever was recorded about the old code; recompiling
+			// the kept definitions records it again.
+			compiler.dependencies.clear();
+			compiler._lazy_owners.clear();
+
+			for(auto slot : definition_order)
+				{
+					if(!reachable[slot])
+						{
+							slots[slot] = wrap<Null>();
+							_bump_version(slot);
+							continue;
+						}
+
+					kept.push_back(slot);
+					compiler.compile(unwrap<Ast>(slots[slot]));
+				}
+
+			auto removed = definition_order.size() - kept.size();
+			definition_order.swap(kept);
+			return removed;
+		}
+
 		pcode::value_type run()
 		{
+			auto finish = compiler.code_store.size();
 			compiler.assemble.finish();
 
 #ifdef DEBUGGING
@@ -100,30 +381,85 @@ namespace atl
 #else
 			vm.run(compiler.code_store);
 #endif
-			compiler.code_store.pop_back();
+			// Lazily compiled bodies may have been added after the
+			// `finish`
+			if(compiler.code_store.size() == finish + 1)
+				{ compiler.code_store.pop_back(); }
+			else
+				{ compiler.code_store.code[finish] = vm_codes::Tag<vm_codes::nop>::value; }
 
 			return vm.stack[0];
 		}
 
+		/** Annotate, compile and run `ast`.  Collections are only put
+		 * off while the annotating and compiling walkers hold raw
+		 * pointers into it; the program runs with the GC free to
+		 * collect, so `ast` has to be reachable from a root which the
+		 * GC updates (like a Marked).
+		 */
 		Any eval_ast(Ast& ast)
 		{
 			namespace pm = pattern_match;
 
+			auto key = ExpressionCache::structural_key(ast);
+			if(!key.empty())
+				{
+					auto entry = expression_cache.find
+						(key, [this](size_t slot) { return _slot_version(slot); });
+					if(entry)
+						{ return _run_segment(entry->segment, entry->type); }
+				}
+
 			auto type = gc.marked(annotate(ast));
 
+			// Definitions will accumulate in the environment, but simple
+			// evaluations should be discarded once we have a result
+			if(pm::match(pm::rest_begins(tag<Define>::value),
+			             ast))
+				{
+					_compile_definition(ast);
+					auto ran = run();
+
+					return Any(unwrap<Type>(*type).value(),
+					           reinterpret_cast<void*>(ran));
+				}
+
+			ExpressionCache::Entry entry;
+			{
+				GC::DeferGC defer(gc);
+				Compile segment(gc);
+				compiler._copy_settings(segment);
+				segment.compile(ast);
+				entry.segment = std::move(segment.code_store);
+			}
+			entry.type = unwrap<Type>(*type).value();
+
+			auto result = _run_segment(entry.segment, entry.type);
+
+			if(!key.empty())
+				{
+					auto reachable = _reachable(_used_slots(ast));
+					for(size_t slot = 0; slot < reachable.size(); ++slot)
+						{
+							if(reachable[slot])
+								{ entry.dependencies.emplace_back(slot, _slot_version(slot)); }
+						}
+					entry.annotated = wrap(ast);
+					expression_cache.insert(key, std::move(entry));
+				}
+			return result;
+		}
+
+		/// \internal Run `segment` after the definitions and drop it.
+		Any _run_segment(Code const& segment, tag_t type)
+		{
 			auto initial_size = compiler.code_store.size();
-			compiler.compile(ast);
+			compiler.code_store.link(segment);
 
 			auto ran = run();
+			compiler.truncate(initial_size);
 
-			// Definitions will accumulate in the environment, but simple
-			// evaluations should be discarded once we have a result
-			if(!pm::match(pm::rest_begins(tag<Define>::value),
-			              ast))
-				{ compiler.code_store.resize(initial_size); }
-
-			return Any(unwrap<Type>(*type).value(),
-			           reinterpret_cast<void*>(ran));
+			return Any(type, reinterpret_cast<void*>(ran));
 		}
 
 		Any eval_ast(GC::ast_composer const& factory)
@@ -154,6 +490,120 @@ namespace atl
 			auto stream = std::istringstream(input);
 			return eval(stream);
 		}
+
+		/**
+		 * Evaluate every form in `stream`.  A reader thread splits
+		 * the stream into forms ahead of the front end, handing them
+		 * over through a bounded queue.  Parsing, resolution and
+		 * type inference share the GC and slots, so they stay on
+		 * this thread, in order.  Each run of consecutive
+		 * definitions is annotated, then compiled as separate
+		 * segments on `threads` workers and linked.  Other forms are
+		 * evaluated as they are reached.
+		 *
+		 * @param threads: compile workers; 0 uses one per core
+		 * @param read_ahead: forms the reader may get ahead by
+		 * @return: value of the last form which wasn't a definition
+		 */
+		Any load(std::istream& stream, size_t threads=0, size_t read_ahead=64)
+		{
+			namespace pm = pattern_match;
+
+			BoundedQueue<std::string> texts(read_ahead);
+			std::exception_ptr read_error;
+			std::atomic<bool> read_failed(false);
+
+			std::thread reader([&]()
+			                   {
+				                   try
+					                   {
+						                   std::string text;
+						                   while(read_form(stream, text) && texts.push(text));
+					                   }
+				                   catch(...)
+					                   {
+						                   read_error = std::current_exception();
+						                   read_failed.store(true, std::memory_order_release);
+					                   }
+				                   texts.close();
+			                   });
+
+			// Stop at the first read error, rather than evaluating
+			// whatever was queued up ahead of it
+			auto check_read = [&]()
+				{
+					if(read_failed.load(std::memory_order_acquire))
+						{ std::rethrow_exception(read_error); }
+				};
+
+			// Stop and join the reader however we leave
+			struct JoinReader
+			{
+				BoundedQueue<std::string>& texts;
+				std::thread& reader;
+				~JoinReader()
+				{
+					texts.close();
+					reader.join();
+				}
+			} join_reader{texts, reader};
+
+			std::vector<Marked<Ast> > definitions;
+			Any result = wrap<Null>();
+
+			auto link_definitions = [&]()
+				{
+					GC::DeferGC defer(gc);
+					std::vector<Ast> forms;
+					for(auto& def : definitions)
+						{ forms.push_back(*def); }
+
+					compiler.compile_segments(forms, threads);
+
+					for(auto& form : forms)
+						{ _record_definition(form); }
+					definitions.clear();
+				};
+
+			std::string text;
+			while(texts.pop(text))
+				{
+					check_read();
+					std::istringstream text_stream(text);
+					auto parsed = Parser(gc, text_stream).parse();
+
+					if(!is<Ast>(*parsed))
+						{ throw WrongTypeError("Not yet dealing with evaling atoms"); }
+
+					// Still unannotated, so `define` is just a Symbol
+					auto ast = gc.marked(unwrap<Ast>(*parsed));
+					if(pm::literal_match(pm::rest_begins("define"), *ast))
+						{
+							// Redefinitions recompile what depended on the
+							// old definition, so they can't share a batch
+							if(_redefined_slot(*ast) != Compile::no_slot)
+								{
+									link_definitions();
+									annotate(*ast);
+									_compile_definition(*ast);
+									continue;
+								}
+
+							annotate(*ast);
+							definitions.push_back(std::move(ast));
+						}
+					else
+						{
+							link_definitions();
+							result = eval_ast(*ast);
+						}
+				}
+
+			check_read();
+			link_definitions();
+
+			return result;
+		}
 	};
 }
 
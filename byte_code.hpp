@@ -35,16 +35,23 @@
 //   return_            : [return-value]
 //   argument           : [offset]
 //   nested_argument    : [offset][hops]
-//   tail_call          : [arg0]..[argN][N][procedure-address]
+//   tail_call          : [arg0]..[argN][closure-address]
+//   rebind_args        : [arg0]..[argN]
 //   call_closure       : [arg0]..[argN][closure-address]
+//   call_procedure     : [arg0]..[argN][N][procedure-address]
+//   tail_procedure     : [arg0]..[argN][N][procedure-address]
 //   closure_argument   : [arg-offset]
 //   make_closure       : [arg1]...[argN][N]
 //   finish             : -
 //   define             : [closure-pointer][slot]
 //   deref_slot         : [slot]
+//   fixnum_add etc     : [a][b]
+//   local              : [depth]
+//   slide              : [word1]...[wordN][value][N]
+//   lazy_compile       : [lambda-metadata-pointer]
 
 
-#define ATL_NORMAL_BYTE_CODES (nop)(push)(pop)(if_)(std_function)(jump)(return_)(argument)(nested_argument)(tail_call)(call_closure)(closure_argument)(make_closure)(deref_slot)(define)
+#define ATL_NORMAL_BYTE_CODES (nop)(push)(pop)(if_)(std_function)(jump)(return_)(argument)(nested_argument)(tail_call)(rebind_args)(call_closure)(call_procedure)(tail_procedure)(closure_argument)(make_closure)(deref_slot)(define)(fixnum_add)(fixnum_sub)(fixnum_eq)(fixnum_lt)(fixnum_gt)(fixnum_le)(fixnum_ge)(local)(slide)(lazy_compile)
 #define ATL_BYTE_CODES (finish)(push_word)ATL_NORMAL_BYTE_CODES
 
 #define ATL_VM_SPECIAL_BYTE_CODES (finish)      // Have to be interpreted specially by the run/switch statement
@@ -154,6 +161,10 @@ namespace atl
 
 		CodeBacker code;
 
+		// Positions of the words which hold a code address.  They
+		// get rebased when the code is linked onto another Code.
+		std::vector<size_t> relocations;
+
 		Code() : num_slots(0) {};
 		Code(size_t initial_size) : num_slots(0), code(initial_size) {}
 
@@ -169,7 +180,36 @@ namespace atl
 
 		void pop_back() { code.pop_back(); }
 
-		void resize(size_t n) { code.resize(n); }
+		void resize(size_t n)
+		{
+			code.resize(n);
+			while(!relocations.empty() && relocations.back() >= n)
+				{ relocations.pop_back(); }
+		}
+
+		/** Append `segment` to this code, rebasing its code
+		 * addresses and labels to wherever it ends up.
+		 *
+		 * @param segment: code compiled as though it started at 0
+		 */
+		void link(Code const& segment)
+		{
+			auto base = code.size();
+
+			code.insert(code.end(), segment.code.begin(), segment.code.end());
+
+			for(auto pos : segment.relocations)
+				{
+					code[base + pos] += base;
+					relocations.push_back(base + pos);
+				}
+
+			for(auto& label : segment.offset_table.table)
+				{ offset_table.set(label.first, label.second + base); }
+
+			if(segment.num_slots > num_slots)
+				{ num_slots = segment.num_slots; }
+		}
 
 		bool operator==(Code const& other) const
 		{ return code == other.code; }
@@ -273,6 +313,14 @@ namespace atl
 
 		AssembleCode& pointer(void const* cc) { return constant(reinterpret_cast<value_type>(cc)); }
 
+		/* Push a location in this code; it will be rebased if the code gets linked. */
+		AssembleCode& code_address(pcode::Offset address)
+		{
+			constant(address);
+			code->relocations.push_back(pos_last());
+			return *this;
+		}
+
 		AssembleCode& push_tagged(const Any& aa)
 		{
 			constant(aa._tag);
@@ -299,6 +347,20 @@ namespace atl
 			return *this;
 		}
 
+		/* Push the value `depth` words above the current frame's base */
+		AssembleCode& local(size_t depth)
+		{
+			constant(depth);
+			return local();
+		}
+
+		/* Drop the `words` values under the top of the stack */
+		AssembleCode& slide(size_t words)
+		{
+			constant(words);
+			return slide();
+		}
+
 		AssembleCode& deref_slot(size_t slot)
 		{
 			constant(slot);
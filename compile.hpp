@@ -13,8 +13,15 @@
 #include "./utility.hpp"
 #include "./helpers/pattern_match.hpp"
 #include "./helpers/itritrs.hpp"
+#include "./lexical_environment.hpp"
 
 #include <set>
+#include <map>
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <exception>
 
 namespace atl
 {
@@ -27,11 +34,85 @@ namespace atl
 		Code code_store;
 		AssembleCode assemble;
 
-		Compile(GC &gc_)
+		// Top level definitions, used to look through global
+		// Symbols at compile time.  May be null.
+		Slots* slots;
+
+		// Calls to known functions with bodies of at most
+		// `inline_limit` cells get inlined; 0 turns inlining off.
+		size_t inline_limit;
+
+		// Functions whose bodies are being inlined right now, so
+		// mutually recursive functions don't expand forever.
+		std::vector<LambdaMetadata*> _inlining;
+
+		// Slots of the functions _pure is looking at.
+		std::vector<size_t> _purity_checking;
+
+		// Slots of the constants _fold is looking through.
+		std::vector<size_t> _folding;
+
+		// Copies of polymorphic global functions compiled for
+		// particular argument types, keyed by the function's slot
+		// and those types.
+		typedef std::pair<size_t, std::vector<tag_t> > Instantiation;
+		std::map<Instantiation, pcode::Offset> _specializations;
+
+		// Leave a stub in place of each lambda's body, which compiles
+		// the body the first time the function is called (the VM's
+		// compile_lazily needs to call compile_lazy_body).
+		bool lazy;
+
+		// Stubs compile_lazy_body has pointed at a compiled body.
+		struct LazyPatch
+		{
+			pcode::Offset stub, body;
+			LambdaMetadata* metadata;
+		};
+		std::vector<LazyPatch> _lazy_patches;
+
+		// For each top level definition, the other definitions its
+		// code was compiled from (by inlining, folding, calling a
+		// specialized copy and so on).  Its code is stale if one of
+		// them changes.
+		std::map<size_t, std::set<size_t> > dependencies;
+
+		// Slot of the definition being compiled, or no_slot.
+		static constexpr size_t no_slot = static_cast<size_t>(-1);
+		size_t _defining;
+
+		// Definitions owning the lambdas left to compile lazily.
+		std::map<LambdaMetadata*, size_t> _lazy_owners;
+
+		// Segments compile_segments has linked onto code_store.
+		size_t linked_segments;
+
+		// Set while compiling a segment on one of compile_segments'
+		// workers.  Other workers may be reading the LambdaMetadata,
+		// so the body addresses of the lambdas compiled go in
+		// _segment_bodies, to be published once they've been linked.
+		bool _in_segment;
+		std::vector<std::pair<LambdaMetadata*, pcode::Offset> > _segment_bodies;
+
+		Compile(GC &gc_, Slots* slots_=nullptr)
 			: gc(gc_),
-			  assemble(&code_store)
+			  assemble(&code_store),
+			  slots(slots_),
+			  inline_limit(24),
+			  lazy(false),
+			  _defining(no_slot),
+			  linked_segments(0),
+			  _in_segment(false)
 		{}
 
+		/// \internal Start `other` with the same settings as this compiler.
+		void _copy_settings(Compile& other) const
+		{
+			other.slots = slots;
+			other.inline_limit = inline_limit;
+			other.lazy = lazy;
+		}
+
 		// Setup a VM jump instruction which skips over the code
 		// defined during the SkipBlock instance's lifetime.
 		struct SkipBlock
@@ -40,7 +121,7 @@ namespace atl
 			AssembleCode& assemble;
 			SkipBlock(AssembleCode& assemble_) : assemble(assemble_)
 			{
-				assemble.pointer(nullptr);
+				assemble.code_address(0);
 				_skip_to = assemble.pos_last();
 				assemble.jump();
 			}
@@ -53,20 +134,929 @@ namespace atl
 		};
 
 
+		struct Inlined;
+
+		// The value of a pure expression computed once, ahead of a
+		// call's arguments, and read back where the expression
+		// appears in them.
+		struct Temp
+		{
+			Any expr;
+			size_t depth;          // frame slot holding the value
+			Inlined *inlined;      // scope `expr`'s Parameters belong to
+			Temp* next;
+		};
+
 		struct Context
 		{
 			LambdaMetadata *closure;
 			bool tail;
 
+			// Set while compiling an inlined function body
+			Inlined *inlined;
+
+			// Where the code for the closure's body starts (it
+			// may be a specialized copy of the closure's code).
+			// Set by whatever compiles the body.
+			pcode::Offset body_address;
+
+			// Static type (as a tag) of each of the closure's
+			// formals, or Undefined where the type checker didn't
+			// settle on a concrete type.
+			std::vector<tag_t> const* param_types;
+
+			// Words between the frame's base and where this
+			// expression's value will go
+			size_t depth;
+
+			// Shared values available to this expression
+			Temp* temps;
+
+			// Set while compiling a lifted lambda's body, which gets
+			// its captured variables as trailing arguments.
+			bool lifted;
+
+			/// Number of arguments in the closure's frame
+			size_t frame_size() const
+			{
+				return closure->formals.size()
+					+ (lifted ? closure->closure.size() : 0);
+			}
+
 			Context just_closure()
-			{ return Context(closure, false); }
+			{
+				Context rval = *this;
+				rval.tail = false;
+				return rval;
+			}
+
+			/// Context for a value pushed `words` above this one's.
+			Context above(size_t words) const
+			{
+				Context rval = *this;
+				rval.tail = false;
+				rval.depth += words;
+				return rval;
+			}
 
-			Context(LambdaMetadata *cc, bool t)
+			Context(LambdaMetadata *cc, bool t, Inlined *inl=nullptr)
 				: closure(cc)
 				, tail(t)
+				, inlined(inl)
+				, body_address(0)
+				, param_types(nullptr)
+				, depth(0)
+				, temps(nullptr)
+				, lifted(false)
 			{}
 		};
 
+		// The body of a function being compiled in place of a call to
+		// it; its Parameters stand for the call's argument
+		// expressions, which get compiled in the caller's context.
+		struct Inlined
+		{
+			std::vector<Any> args;
+			Context outer;
+
+			// Set when the arguments were evaluated into the frame
+			// (the first at depth `locals`) rather than being
+			// substituted; the lambda whose body this is.
+			LambdaMetadata *frame_locals;
+			size_t locals;
+
+			// For each local bound to a lifted lambda, where its body
+			// starts; 0 for the others (a SkipBlock always comes
+			// before a body, so none starts at 0).
+			std::vector<pcode::Offset> lifted;
+
+			Inlined(Context const& outer_)
+				: outer(outer_)
+				, frame_locals(nullptr)
+				, locals(0)
+			{}
+		};
+
+		/// \internal Note that the definition being compiled looked
+		/// at the definition in `slot`.
+		void _depend_on(size_t slot)
+		{
+			if(_defining != no_slot && slot != _defining)
+				{ dependencies[_defining].insert(slot); }
+		}
+
+		/** Is the code for the definition in `slot` compiled from any
+		 * of the definitions in `changed`?
+		 */
+		bool depends_on(size_t slot, std::set<size_t> const& changed) const
+		{
+			auto found = dependencies.find(slot);
+			if(found == dependencies.end())
+				{ return false; }
+
+			for(auto used : found->second)
+				{
+					if(changed.count(used))
+						{ return true; }
+				}
+			return false;
+		}
+
+		/// \internal If global `slot` was defined as a lambda, set
+		/// `lambda` to the (\ formals body) expression.
+		bool _known_lambda(size_t slot, Any& lambda)
+		{
+			if(!slots || slot >= slots->size())
+				{ return false; }
+
+			auto& definition = (*slots)[slot];
+			if(!is<Ast>(definition))
+				{ return false; }
+
+			// (define sym value)
+			auto def = atl::subex(definition);
+			if(def.size() != 3)
+				{ return false; }
+
+			auto value = def.begin() + 2;
+			if(value.tag() != tag<Ast>::value)
+				{ return false; }
+
+			lambda = *value;
+			auto inner = atl::subex(lambda).begin();
+			if(inner.tag() != tag<Lambda>::value)
+				{ return false; }
+
+			_depend_on(slot);
+			return true;
+		}
+
+		/// \internal Does evaluating `any` have no side effects?
+		/// Conservative; atoms, Ifs of pure expressions, and pure
+		/// arguments to pure CxxFunctors or to known functions with
+		/// pure bodies qualify.
+		bool _pure(Any& any)
+		{
+			switch(any._tag)
+				{
+				case tag<AstData>::value:
+				case tag<Ast>::value:
+					{
+						auto subex = atl::subex(any);
+						auto inner = subex.begin();
+
+						switch(inner.tag())
+							{
+							case tag<If>::value:
+								break;
+
+							case tag<CxxFunctor>::value:
+								if(!unwrap<CxxFunctor>(*inner).pure)
+									{ return false; }
+								break;
+
+							case tag<Symbol>::value:
+								{
+									auto slot = unwrap<Symbol>(*inner).slot;
+									Any lambda;
+									if(!_known_lambda(slot, lambda))
+										{ return false; }
+
+									// Assume recursive calls are pure until
+									// shown otherwise
+									if(std::find(_purity_checking.begin(), _purity_checking.end(), slot)
+									   != _purity_checking.end())
+										{ break; }
+
+									auto body = *(atl::subex(lambda).begin() + 2);
+
+									_purity_checking.push_back(slot);
+									auto pure_body = _pure(body);
+									_purity_checking.pop_back();
+
+									if(!pure_body)
+										{ return false; }
+									break;
+								}
+							default:
+								return false;
+							}
+
+						for(auto arg : slice(itritrs(subex), 1))
+							{
+								auto value = *arg;
+								if(!_pure(value)) { return false; }
+							}
+						return true;
+					}
+				default:
+					return true;
+				}
+		}
+
+		/// \internal The cells making up `any`.
+		static Range<Any*> _flat(Any& any)
+		{
+			switch(any._tag)
+				{
+				case tag<Ast>::value:
+					{
+						auto& ast = unwrap<Ast>(any);
+						return make_range(ast.flat_begin(), ast.flat_end());
+					}
+				case tag<AstData>::value:
+					{
+						auto& data = reinterpret_cast<AstData&>(any);
+						return make_range(data.flat_begin(), data.flat_end());
+					}
+				default:
+					return make_range(&any, &any + 1);
+				}
+		}
+
+		/// \internal Are `aa` and `bb` the same expression?  Symbols
+		/// match by slot, since each use of a name is its own Symbol.
+		static bool _same_expr(Any& aa, Any& bb)
+		{
+			auto left = _flat(aa), right = _flat(bb);
+			if(left.size() != right.size())
+				{ return false; }
+
+			for(auto litr = left.begin(), ritr = right.begin();
+			    litr != left.end();
+			    ++litr, ++ritr)
+				{
+					if(litr->_tag != ritr->_tag)
+						{ return false; }
+
+					if(litr->_tag == tag<Symbol>::value)
+						{
+							if(unwrap<Symbol>(*litr).slot != unwrap<Symbol>(*ritr).slot)
+								{ return false; }
+						}
+					else if(litr->value != ritr->value)
+						{ return false; }
+				}
+			return true;
+		}
+
+		/// \internal A Temp holding the value of `any`, or null.
+		Temp* _find_temp(Any& any, Context const& context)
+		{
+			for(auto temp = context.temps; temp; temp = temp->next)
+				{
+					if(temp->inlined == context.inlined
+					   && _same_expr(temp->expr, any))
+						{ return temp; }
+				}
+			return nullptr;
+		}
+
+		/// \internal Add the sub-expressions of `any` which will
+		/// certainly be evaluated along with it to `found`.  Lambda
+		/// bodies and If branches aren't.
+		void _evaluated_subexpressions(Any& any, std::vector<Any>& found)
+		{
+			if(!is<Ast>(any))
+				{ return; }
+
+			found.push_back(any);
+
+			auto subex = atl::subex(any);
+			switch(subex.begin().tag())
+				{
+				case tag<Lambda>::value:
+				case tag<Quote>::value:
+				case tag<Define>::value:
+					found.pop_back();
+					return;
+
+				case tag<If>::value:
+					{
+						auto predicate = *(subex.begin() + 1);
+						_evaluated_subexpressions(predicate, found);
+						return;
+					}
+				}
+
+			for(auto arg : slice(itritrs(subex), 1))
+				{
+					auto value = *arg;
+					_evaluated_subexpressions(value, found);
+				}
+		}
+
+		/// \internal Is sharing the value of `any` likely to beat
+		/// computing it again?  It has to involve a call which isn't
+		/// a single instruction, or be large.
+		bool _worth_sharing(Any& any)
+		{
+			auto flat = _flat(any);
+			if(flat.size() >= 8)
+				{ return true; }
+
+			for(auto& cell : flat)
+				{
+					if(cell._tag == tag<Symbol>::value
+					   || (cell._tag == tag<CxxFunctor>::value
+					       && !unwrap<CxxFunctor>(cell).native_instruction))
+						{ return true; }
+				}
+			return false;
+		}
+
+		/// \internal Pick the outermost pure expressions in `any`
+		/// which occur in `found` more than once.
+		void _select_shared(Any& any,
+		                    std::vector<Any>& found,
+		                    std::vector<Any>& shared,
+		                    Context const& context)
+		{
+			if(!is<Ast>(any))
+				{ return; }
+
+			for(auto& already : shared)
+				{ if(_same_expr(already, any)) { return; } }
+
+			size_t occurrences = 0;
+			for(auto& other : found)
+				{ if(_same_expr(other, any)) { ++occurrences; } }
+
+			pcode::value_type folded;
+			if(occurrences > 1
+			   && !_find_temp(any, context)
+			   && _worth_sharing(any)
+			   && _pure(any)
+			   && !_fold(any, folded, context))
+				{
+					shared.push_back(any);
+					return;
+				}
+
+			auto subex = atl::subex(any);
+			switch(subex.begin().tag())
+				{
+				case tag<Lambda>::value:
+				case tag<Quote>::value:
+				case tag<Define>::value:
+					return;
+
+				case tag<If>::value:
+					{
+						auto predicate = *(subex.begin() + 1);
+						_select_shared(predicate, found, shared, context);
+						return;
+					}
+				}
+
+			for(auto arg : slice(itritrs(subex), 1))
+				{
+					auto value = *arg;
+					_select_shared(value, found, shared, context);
+				}
+		}
+
+		/// \internal Try to compile a call to the known function
+		/// `lambda` by compiling its body in place.  The function
+		/// must be small, non-recursive, and each argument must be
+		/// an atom or a pure expression its parameter uses at most
+		/// once (so inlining can't duplicate, drop or reorder side
+		/// effects).
+		///
+		/// @param lambda: the (\ formals body) being called
+		/// @param call: the call expression
+		/// @param context: context of the call
+		/// @return: false, having emitted nothing, if the call wasn't inlined
+		bool _inline(Any& lambda, Ast::Subex& call, Context& context)
+		{
+			if(!inline_limit)
+				{ return false; }
+
+			auto parts = atl::subex(lambda);
+			auto& metadata = *unwrap<Lambda>(*parts.begin()).value;
+
+			if(metadata.noinline
+			   || !metadata.closure.empty()
+			   || std::find(_inlining.begin(), _inlining.end(), &metadata) != _inlining.end())
+				{ return false; }
+
+			auto self = unwrap<Symbol>(*call.begin()).slot;
+			auto body = *(parts.begin() + 2);
+
+			Any* flat_begin = &body;
+			Any* flat_end = flat_begin + 1;
+			if(is<Ast>(body))
+				{
+					auto& ast = unwrap<Ast>(body);
+					if(ast.flat_size() > inline_limit)
+						{ return false; }
+					flat_begin = ast.flat_begin();
+					flat_end = ast.flat_end();
+				}
+
+			std::vector<size_t> uses(metadata.formals.size(), 0);
+			for(auto itr = flat_begin; itr != flat_end; ++itr)
+				{
+					switch(itr->_tag)
+						{
+						case tag<Lambda>::value:
+						case tag<Define>::value:
+						case tag<Quote>::value:
+						case tag<ClosureParameter>::value:
+							return false;
+
+						case tag<Symbol>::value:
+							if(unwrap<Symbol>(*itr).slot == self)
+								{ return false; }
+							break;
+
+						case tag<Parameter>::value:
+							++uses[unwrap<Parameter>(*itr).value];
+							break;
+						}
+				}
+
+			Inlined inlined(context.just_closure());
+			for(auto arg : slice(itritrs(call), 1))
+				{ inlined.args.push_back(*arg); }
+
+			if(inlined.args.size() != uses.size())
+				{ return false; }
+
+			for(size_t idx = 0; idx < uses.size(); ++idx)
+				{
+					auto& arg = inlined.args[idx];
+					if(is<Ast>(arg) && !(uses[idx] == 1 && _pure(arg)))
+						{ return false; }
+				}
+
+			Context inner = context;
+			inner.inlined = &inlined;
+
+			_inlining.push_back(&metadata);
+			try
+				{ _compile(body, inner); }
+			catch(...)
+				{
+					_inlining.pop_back();
+					throw;
+				}
+			_inlining.pop_back();
+
+			return true;
+		}
+
+		/// \internal Set `tag` to the concrete type `type` stands for.
+		static bool _concrete_type(Any const& type, tag_t& tag)
+		{
+			if(!is<Type>(type))
+				{ return false; }
+
+			tag = unwrap<Type>(type).value();
+			return tag < LAST_CONCRETE_TYPE;
+		}
+
+		/// \internal The static types of `metadata`'s formals, as
+		/// inferred by the type checker.
+		static std::vector<tag_t> _formal_types(LambdaMetadata& metadata)
+		{
+			std::vector<tag_t> types;
+			for(auto formal : metadata.formals)
+				{
+					tag_t tag = atl::tag<Undefined>::value;
+					if(is<Symbol>(formal))
+						{ _concrete_type(unwrap<Symbol>(formal).scheme.type, tag); }
+					types.push_back(tag);
+				}
+			return types;
+		}
+
+		/// \internal Set `type` to the tag of the value `any` will
+		/// evaluate to, if it has a concrete static type.
+		bool _static_type(Any& any, tag_t& type, Context const& context)
+		{
+			switch(any._tag)
+				{
+				case tag<Fixnum>::value:
+				case tag<Bool>::value:
+					type = any._tag;
+					return true;
+
+				case tag<Parameter>::value:
+					{
+						auto idx = unwrap<Parameter>(any).value;
+						if(context.inlined)
+							{
+								auto& inlined = *context.inlined;
+								return _static_type(inlined.args[idx], type, inlined.outer);
+							}
+
+						if(!context.param_types)
+							{ return false; }
+
+						type = (*context.param_types)[idx];
+						return type != tag<Undefined>::value;
+					}
+
+				case tag<Symbol>::value:
+					return _concrete_type(unwrap<Symbol>(any).scheme.type, type);
+
+				case tag<AstData>::value:
+				case tag<Ast>::value:
+					{
+						// Only know the result types of primitives
+						auto subex = atl::subex(any);
+						if(subex.begin().tag() != tag<CxxFunctor>::value)
+							{ return false; }
+
+						// (-> a (-> b c)); peel off an arrow per argument
+						Any fn_type = wrap(unwrap<CxxFunctor>(*subex.begin()).type);
+						auto arg_count = subex.size() - 1;
+						for(size_t idx = 0; idx < std::max<size_t>(arg_count, 1); ++idx)
+							{
+								if(!is<Ast>(fn_type))
+									{ return false; }
+								auto& arrow = unwrap<Ast>(fn_type);
+								fn_type = arrow[arrow.size() - 1];
+							}
+
+						return _concrete_type(fn_type, type);
+					}
+				default:
+					return false;
+				}
+		}
+
+		/// \internal Find or compile a copy of the polymorphic global
+		/// function `lambda` for the argument types of `call`.
+		/// Inside the copy the formals have those concrete types, so
+		/// the body can use instructions specialized on them.  The
+		/// copy doesn't need a closure, so it gets called with
+		/// call_procedure.
+		///
+		/// @param slot: global slot `lambda` is defined in
+		/// @param lambda: the (\ formals body) being called
+		/// @param call: the call expression
+		/// @param context: context of the call
+		/// @param address: set to the start of the copy's code
+		/// @return: false if there's nothing to gain from a copy
+		bool _specialization(size_t slot, Any& lambda, Ast::Subex& call, Context& context,
+		                     pcode::Offset& address)
+		{
+			auto parts = atl::subex(lambda);
+			auto& metadata = *unwrap<Lambda>(*parts.begin()).value;
+
+			if(!metadata.closure.empty()
+			   || metadata.formals.size() != call.size() - 1)
+				{ return false; }
+
+			auto generic = _formal_types(metadata);
+			std::vector<tag_t> types;
+			bool narrower = false;
+
+			for(auto arg : slice(itritrs(call), 1))
+				{
+					auto value = *arg;
+					tag_t type;
+					if(!_static_type(value, type, context))
+						{ return false; }
+
+					narrower |= (generic[types.size()] != type);
+					types.push_back(type);
+				}
+
+			if(!narrower)
+				{ return false; }
+
+			auto key = Instantiation(slot, types);
+			auto found = _specializations.find(key);
+			if(found != _specializations.end())
+				{
+					address = found->second;
+					return true;
+				}
+
+			SkipBlock my_def(assemble);
+			address = assemble.pos_end();
+
+			// register the copy first so recursive calls find it
+			_specializations[key] = address;
+
+			Context body(&metadata, true);
+			body.param_types = &types;
+			body.body_address = address;
+
+			auto body_expr = *(parts.begin() + 2);
+			try
+				{ _compile(body_expr, body); }
+			catch(...)
+				{
+					_specializations.erase(key);
+					throw;
+				}
+			assemble.return_();
+
+			return true;
+		}
+
+		/// \internal Are all the arguments of `call` statically
+		/// known to be Fixnums?
+		bool _fixnum_args(Ast::Subex& call, Context const& context)
+		{
+			for(auto arg : slice(itritrs(call), 1))
+				{
+					auto value = *arg;
+					tag_t type;
+					if(!_static_type(value, type, context) || type != tag<Fixnum>::value)
+						{ return false; }
+				}
+			return true;
+		}
+
+		/// \internal Is Parameter `idx` only ever used as the head of
+		/// a call in `any`?  A lambda which captures it counts as a use
+		/// which isn't a call.
+		static bool _only_called(Any& any, size_t idx)
+		{
+			switch(any._tag)
+				{
+				case tag<Parameter>::value:
+					return unwrap<Parameter>(any).value != idx;
+
+				case tag<AstData>::value:
+				case tag<Ast>::value:
+					{
+						auto subex = atl::subex(any);
+						auto inner = subex.begin();
+
+						switch(inner.tag())
+							{
+							case tag<Quote>::value:
+								return true;
+
+							case tag<Lambda>::value:
+								for(auto captured : unwrap<Lambda>(*inner).value->closure)
+									{
+										if(!_only_called(captured, idx))
+											{ return false; }
+									}
+								return true;
+							}
+
+						auto head = *inner;
+						if(!is<Parameter>(head) && !_only_called(head, idx))
+							{ return false; }
+
+						for(auto arg : slice(itritrs(subex), 1))
+							{
+								auto value = *arg;
+								if(!_only_called(value, idx))
+									{ return false; }
+							}
+						return true;
+					}
+				default:
+					return true;
+				}
+		}
+
+		/// \internal Which arguments of `call`, whose head is
+		/// `head`, are lambdas `head` binds to a local which is only
+		/// ever called?  They can't escape, so they can be lifted.
+		static std::vector<bool> _liftable(Any& head, Ast::Subex& call)
+		{
+			std::vector<bool> liftable(call.size() - 1, false);
+			if(!is<Ast>(head))
+				{ return liftable; }
+
+			auto parts = atl::subex(head);
+			if(parts.begin().tag() != tag<Lambda>::value
+			   || unwrap<Lambda>(*parts.begin()).value->formals.size() != liftable.size())
+				{ return liftable; }
+
+			auto body = *(parts.begin() + 2);
+			size_t idx = 0;
+			for(auto arg : slice(itritrs(call), 1))
+				{
+					auto value = *arg;
+					liftable[idx] = is<Ast>(value)
+						&& atl::subex(value).begin().tag() == tag<Lambda>::value
+						&& _only_called(body, idx);
+					++idx;
+				}
+			return liftable;
+		}
+
+		/// \internal Emit the body of `lambda` once as a plain
+		/// procedure, which gets the variables the lambda captures as
+		/// extra arguments after its own, and push a placeholder
+		/// where its closure would have gone.
+		///
+		/// @return: address of the lifted body
+		pcode::Offset _lift(Any& lambda)
+		{
+			auto parts = atl::subex(lambda);
+			auto& metadata = *unwrap<Lambda>(*parts.begin()).value;
+
+			pcode::Offset address;
+			{
+				SkipBlock my_def(assemble);
+				address = assemble.pos_end();
+
+				auto types = _formal_types(metadata);
+				Context body(&metadata, true);
+				body.param_types = &types;
+				body.body_address = address;
+				body.lifted = true;
+
+				auto body_expr = *(parts.begin() + 2);
+				_compile(body_expr, body);
+				assemble.return_();
+			}
+
+			assemble.constant(0);
+			return address;
+		}
+
+		/// \internal Compile a call to a local bound to a lifted
+		/// lambda.  The captured variables get pushed after the
+		/// call's arguments (which must already be on the stack) and
+		/// the lifted body is called directly.
+		///
+		/// @param head: the Parameter being called
+		/// @param arg_count: number of arguments already compiled
+		/// @param context: context of the call
+		/// @param base: context of the first argument
+		/// @return: false, having emitted nothing, if `head` isn't lifted
+		bool _lifted_call(Any& head, size_t arg_count, Context& context, Context const& base)
+		{
+			if(!context.inlined || !context.inlined->frame_locals)
+				{ return false; }
+
+			auto& locals = *context.inlined;
+			auto idx = unwrap<Parameter>(head).value;
+			if(idx >= locals.lifted.size() || !locals.lifted[idx])
+				{ return false; }
+
+			auto& metadata = *unwrap<Lambda>(*atl::subex(locals.args[idx]).begin()).value;
+			if(metadata.formals.size() != arg_count)
+				{ return false; }
+
+			// Captured in the scope the lambda was bound in
+			auto outer = locals.outer;
+			for(size_t cc = 0; cc < metadata.closure.size(); ++cc)
+				{
+					outer.depth = base.depth + arg_count + cc;
+					_compile(metadata.closure[cc], outer);
+				}
+
+			assemble.constant(arg_count + metadata.closure.size());
+			assemble.code_address(locals.lifted[idx]);
+
+			if(context.tail && context.closure)
+				{ assemble.tail_procedure(); }
+			else
+				{ assemble.call_procedure(); }
+			return true;
+		}
+
+		/// \internal Compile the body of a call whose head is a
+		/// lambda expression (ie a `let`) in place.  The arguments,
+		/// already on the stack, become locals of the current frame,
+		/// so there's no closure, call or return.
+		///
+		/// @param head: the (\ formals body) being called
+		/// @param call: the call expression
+		/// @param context: context of the call; the first argument is at its depth
+		/// @param tail: is the call in tail position
+		/// @param lifted: body addresses of the arguments which were lifted (see _lift)
+		/// @return: false, having emitted nothing, if `head` isn't a lambda
+		bool _bind_locals(Any& head, Ast::Subex& call, Context& context, bool tail,
+		                  std::vector<pcode::Offset> const& lifted)
+		{
+			auto parts = atl::subex(head);
+			auto inner = parts.begin();
+			if(inner.tag() != tag<Lambda>::value)
+				{ return false; }
+
+			auto& metadata = *unwrap<Lambda>(*inner).value;
+			auto arg_count = call.size() - 1;
+			if(metadata.formals.size() != arg_count)
+				{ return false; }
+
+			Inlined locals(context.just_closure());
+			for(auto arg : slice(itritrs(call), 1))
+				{ locals.args.push_back(*arg); }
+			locals.frame_locals = &metadata;
+			locals.locals = context.depth;
+			locals.lifted = lifted;
+
+			Context body = context.above(arg_count);
+			body.tail = tail;
+			body.inlined = &locals;
+
+			auto body_expr = *(inner + 2);
+			_compile(body_expr, body);
+
+			// (unreachable after a tail call, which replaces the frame)
+			if(arg_count)
+				{ assemble.slide(arg_count); }
+			return true;
+		}
+
+		/// \internal Try to evaluate `any` at compile time.  Literals
+		/// fold to themselves, globals defined as foldable expressions
+		/// fold to their values, and applications of pure CxxFunctors
+		/// fold when all their arguments do.
+		///
+		/// @param any: the expression to fold
+		/// @param value: set to the folded value on success
+		/// @param context: context `any` appears in
+		/// @return: true if `any` could be folded
+		bool _fold(Any& any, pcode::value_type& value, Context context)
+		{
+			switch(any._tag)
+				{
+				case tag<Parameter>::value:
+					if(context.inlined)
+						{
+							auto& inlined = *context.inlined;
+							return _fold(inlined.args[unwrap<Parameter>(any).value],
+							             value,
+							             inlined.outer);
+						}
+					return false;
+
+				case tag<Fixnum>::value:
+					value = unwrap<Fixnum>(any).value;
+					return true;
+
+				case tag<Bool>::value:
+					value = unwrap<Bool>(any).value;
+					return true;
+
+				case tag<Symbol>::value:
+					{
+						auto slot = unwrap<Symbol>(any).slot;
+						if(!slots || slot >= slots->size()
+						   || !is<Ast>((*slots)[slot])
+						   || std::find(_folding.begin(), _folding.end(), slot) != _folding.end())
+							{ return false; }
+
+						// (define sym value)
+						auto def = atl::subex((*slots)[slot]);
+						if(def.size() != 3)
+							{ return false; }
+
+						auto definition = *(def.begin() + 2);
+
+						_folding.push_back(slot);
+						auto folded = _fold(definition, value, Context(nullptr, false));
+						_folding.pop_back();
+
+						if(folded)
+							{ _depend_on(slot); }
+						return folded;
+					}
+
+				case tag<AstData>::value:
+				case tag<Ast>::value:
+					{
+						auto subex = atl::subex(any);
+						auto inner = subex.begin();
+
+						if(inner.tag() != tag<CxxFunctor>::value)
+							{ return false; }
+
+						auto& fn = unwrap<CxxFunctor>(*inner);
+						if(!fn.pure || fn.variadic)
+							{ return false; }
+
+						// the result is written over the first argument,
+						// so thunks still need one word
+						std::vector<pcode::value_type> args(std::max<size_t>(fn.arity, 1));
+						size_t arg_count = 0;
+						for(auto arg : slice(itritrs(subex), 1))
+							{
+								auto arg_value = *arg;
+								if(arg_count == fn.arity
+								   || !_fold(arg_value, args[arg_count], context))
+									{ return false; }
+								++arg_count;
+							}
+
+						if(arg_count != fn.arity)
+							{ return false; }
+
+						fn.fn(args.data(), args.data() + arg_count);
+						value = args[0];
+						return true;
+					}
+				default:
+					return false;
+				}
+		}
+
 		/// \internal Take an input and generate byte-code.
 		///
 		/// @param itr: the thing to compile
@@ -79,6 +1069,12 @@ namespace atl
 			case tag<AstData>::value:
 			case tag<Ast>::value:
 				{
+					if(auto temp = _find_temp(any, context))
+						{
+							assemble.local(temp->depth);
+							return;
+						}
+
 					auto subex = atl::subex(any);
 					auto inner = subex.begin();
 
@@ -89,15 +1085,28 @@ namespace atl
 						{
 						case tag<If>::value:
 							{
+								// Only the live branch of a constant predicate
+								// is needed
+								{
+									auto predicate = *(inner + 1);
+									pcode::value_type value;
+									if(_fold(predicate, value, context))
+										{
+											auto branch = *(inner + (value ? 2 : 3));
+											_compile(branch, context);
+											return;
+										}
+								}
+
 								auto will_jump = [&]() -> pcode::Offset {
-									assemble.pointer(nullptr);
+									assemble.code_address(0);
 									return assemble.pos_last();
 								};
 
 								auto alt_address = will_jump();
 
 								++inner;
-								_compile(inner, context.just_closure()); // get the predicate
+								_compile(inner, context.above(1)); // get the predicate
 								assemble.if_();
 
 								// consiquent
@@ -125,7 +1134,18 @@ namespace atl
 
 								++inner;
 
-								_compile(inner, Context(context.closure, true));
+								auto outer_definition = _defining;
+								_defining = sym.slot;
+								dependencies[sym.slot].clear();
+								try
+									{ _compile(inner, context.above(0)); }
+								catch(...)
+									{
+										_defining = outer_definition;
+										throw;
+									}
+								_defining = outer_definition;
+
 								assemble.add_label(sym.name);
 								assemble.define(sym.slot);
 
@@ -134,22 +1154,41 @@ namespace atl
 						case tag<Lambda>::value:
 							{
 								auto& metadata = *unwrap<Lambda>(*inner).value;
+								pcode::Offset body_address;
 								{
 									SkipBlock my_def(assemble);
 
-									metadata.body_address = assemble.pos_end();
+									body_address = assemble.pos_end();
+									if(_in_segment)
+										{ _segment_bodies.emplace_back(&metadata, body_address); }
+									else
+										{ metadata.body_address = body_address; }
 
 									++inner; // formals were processed in assign_free
 									++inner;
-									_compile(inner, Context(&metadata,
-									                        true));
-									assemble.return_();
+
+									if(lazy)
+										{
+											metadata.lazy_body = *inner;
+											_lazy_owners[&metadata] = _defining;
+											assemble.pointer(&metadata).lazy_compile();
+										}
+									else
+										{
+											auto types = _formal_types(metadata);
+											Context body(&metadata, true);
+											body.param_types = &types;
+											body.body_address = body_address;
+
+											_compile(inner, body);
+											assemble.return_();
+										}
 								}
 
-								assemble.constant(metadata.body_address);
+								assemble.code_address(body_address);
 
-								for(auto& var : metadata.closure)
-									{ _compile(var, context.just_closure()); }
+								for(size_t idx = 0; idx < metadata.closure.size(); ++idx)
+									{ _compile(metadata.closure[idx], context.above(1 + idx)); }
 
 								assemble.make_closure(metadata.formals.size(),
 								                      metadata.closure.size());
@@ -168,24 +1207,168 @@ namespace atl
 					/*****************/
 					/* normal order: */
 					/*****************/
+					{
+						pcode::value_type folded;
+						if(_fold(any, folded, context))
+							{
+								assemble.constant(folded);
+								return;
+							}
+					}
+
+					// A call to the function we're in from tail position
+					// can re-use the frame and jump back to the top.
+					bool self_tail_call = false;
+
+					// Or we may call a copy specialized for the argument types
+					bool specialized = false;
+					pcode::Offset specialized_address = 0;
+
+					if(inner.tag() == tag<Symbol>::value)
+						{
+							auto slot = unwrap<Symbol>(*inner).slot;
+							Any lambda;
+							if(_known_lambda(slot, lambda))
+								{
+									if(_inline(lambda, subex, context))
+										{ return; }
+
+									auto metadata = unwrap<Lambda>(*atl::subex(lambda).begin()).value;
+									self_tail_call = context.tail
+										&& metadata == context.closure
+										&& metadata->formals.size() == subex.size() - 1;
+
+									if(!self_tail_call)
+										{
+											specialized = _specialization
+												(slot, lambda, subex, context, specialized_address);
+										}
+								}
+						}
+
+					// Pure expressions repeated in the arguments get
+					// computed once, into temporaries under the args.
+					std::vector<Temp> temps;
+					{
+						std::vector<Any> found, shared;
+						for(auto arg : slice(itritrs(subex), 1))
+							{
+								auto value = *arg;
+								_evaluated_subexpressions(value, found);
+							}
+						for(auto arg : slice(itritrs(subex), 1))
+							{
+								auto value = *arg;
+								_select_shared(value, found, shared, context);
+							}
+
+						// inner expressions first; bigger ones may use them
+						std::stable_sort(shared.begin(), shared.end(),
+						                 [](Any aa, Any bb)
+						                 { return _flat(aa).size() < _flat(bb).size(); });
+
+						temps.resize(shared.size());
+						auto chain = context.temps;
+						for(size_t idx = 0; idx < shared.size(); ++idx)
+							{
+								auto temp_context = context.above(idx);
+								temp_context.temps = chain;
+								_compile(shared[idx], temp_context);
+
+								temps[idx] = Temp{shared[idx], context.depth + idx, context.inlined, chain};
+								chain = &temps[idx];
+							}
+					}
+
+					// The rest of the call sits above the temporaries
+					Context base = context;
+					base.depth += temps.size();
+					if(!temps.empty())
+						{ base.temps = &temps.back(); }
+
+					auto drop_temps = [&]()
+						{
+							if(!temps.empty())
+								{ assemble.slide(temps.size()); }
+						};
+
+					// Lambdas a `let` binds which are only ever called
+					// get lifted rather than made into closures
+					std::vector<bool> liftable;
+					std::vector<pcode::Offset> lifted;
+					if(inner.tag() == tag<Ast>::value)
+						{
+							auto head = *inner;
+							liftable = _liftable(head, subex);
+							lifted.resize(liftable.size(), 0);
+						}
+
 					// Compile the args:
 					size_t arg_count = 0;
 					for(auto arg : slice(itritrs(subex), 1))
 						{
+							if(arg_count < liftable.size() && liftable[arg_count])
+								{
+									auto lambda = *arg;
+									lifted[arg_count] = _lift(lambda);
+								}
+							else
+								{ _compile(arg, base.above(arg_count)); }
 							++arg_count;
-							_compile(arg, context.just_closure());
 						}
 
+					if(self_tail_call)
+						{
+							assemble.rebind_args();
+							assemble.code_address(context.body_address);
+							assemble.jump();
+							return;
+						}
+
+					if(specialized)
+						{
+							assemble.constant(arg_count);
+							assemble.code_address(specialized_address);
+							if(context.tail && context.closure)
+								{ assemble.tail_procedure(); }
+							else
+								{
+									assemble.call_procedure();
+									drop_temps();
+								}
+							return;
+						}
+
+					// Calls in tail position replace our frame; at the top
+					// level there's no frame to replace.
+					auto call = [&]()
+						{
+							if(context.tail && context.closure)
+								{ assemble.tail_call(); }
+							else
+								{
+									assemble.call_closure();
+									drop_temps();
+								}
+						};
+
 					switch(inner.tag())
 						{
 						case tag<Ast>::value:
 							{
+								auto head = *inner;
+								if(_bind_locals(head, subex, base, context.tail && context.closure, lifted))
+									{
+										drop_temps();
+										return;
+									}
+
 								// The Ast must return a closure.
 								// TODO: wrap primitive functions in a
 								// closure if they're getting returned
 
-								_compile(inner, context.just_closure());
-								assemble.call_closure();
+								_compile(inner, base.above(arg_count));
+								call();
 								return;
 							}
 						case tag<CxxFunctor>::value:
@@ -201,7 +1384,12 @@ namespace atl
 											 std::to_string(arg_count));
 									}
 
-								assemble.std_function(&fn.fn, arg_count);
+								if(fn.native_instruction && _fixnum_args(subex, context))
+									{ assemble._push_back(fn.native_instruction); }
+								else
+									{ assemble.std_function(&fn.fn, arg_count); }
+
+								drop_temps();
 								return;
 							}
 						case tag<Symbol>::value:
@@ -210,9 +1398,19 @@ namespace atl
 
 								auto& sym = unwrap<Symbol>(*inner);
 								assemble.deref_slot(sym.slot);
-								assemble.call_closure();
+								call();
 								return;
 							}
+						case tag<Parameter>::value:
+							{
+								auto head = *inner;
+								if(_lifted_call(head, arg_count, context, base))
+									{
+										drop_temps();
+										return;
+									}
+								// Closures passed as arguments can't be called yet
+							}
 						default:
 							throw WrongTypeError
 								(std::string("Dunno how to use ")
@@ -241,17 +1439,61 @@ namespace atl
 
 			case tag<Parameter>::value:
 				{
+					if(context.inlined && context.inlined->frame_locals)
+						{
+							assemble.local(context.inlined->locals + unwrap<Parameter>(any).value);
+							return;
+						}
+
+					if(context.inlined)
+						{
+							auto& inlined = *context.inlined;
+
+							// the argument's value goes where we are
+							auto outer = inlined.outer;
+							outer.depth = context.depth;
+
+							_compile(inlined.args[unwrap<Parameter>(any).value], outer);
+							return;
+						}
+
 					assemble.argument
-						(context.closure->formals.size() - 1 - unwrap<Parameter>(any).value);
+						(context.frame_size() - 1 - unwrap<Parameter>(any).value);
 					return;
 				}
 			case tag<ClosureParameter>::value:
 				{
-					assemble.closure_argument(unwrap<ClosureParameter>(any).value);
+					auto idx = unwrap<ClosureParameter>(any).value;
+
+					// A variable from outside a `let` body
+					if(context.inlined && context.inlined->frame_locals)
+						{
+							auto outer = context.inlined->outer;
+							outer.depth = context.depth;
+
+							_compile(context.inlined->frame_locals->closure[idx], outer);
+							return;
+						}
+
+					if(context.lifted)
+						{
+							assemble.argument(context.frame_size() - 1
+							                  - context.closure->formals.size() - idx);
+							return;
+						}
+
+					assemble.closure_argument(idx);
 					return;
 				}
 			case tag<Symbol>::value:
 				{
+					pcode::value_type folded;
+					if(_fold(any, folded, context))
+						{
+							assemble.constant(folded);
+							return;
+						}
+
 					assemble.deref_slot(unwrap<Symbol>(any).slot);
 					return;
 				}
@@ -271,6 +1513,147 @@ namespace atl
 			_compile(value, context);
 		}
 
+		/// \internal A block of code truncate keeps by moving it to `to`.
+		struct MovedBlock
+		{ pcode::Offset begin, end, to; };
+
+		/// \internal Where `address` ends up once the code past
+		/// `size` has been dropped, except for the `moved` blocks.
+		///
+		/// @param past_end: also move the address just past a block
+		/// (ie a jump over it), rather than just its contents
+		/// @return: false if `address` gets dropped
+		static bool _relocate(std::vector<MovedBlock> const& moved, size_t size,
+		                      pcode::Offset& address, bool past_end=false)
+		{
+			if(address < size)
+				{ return true; }
+
+			for(auto& block : moved)
+				{
+					if(address >= block.begin
+					   && (address < block.end || (past_end && address == block.end)))
+						{
+							address = address - block.begin + block.to;
+							return true;
+						}
+				}
+			return false;
+		}
+
+		/** Throw away the code from `size` on, along with anything
+		 * cached about it.  Lazily compiled bodies whose stubs are
+		 * kept get moved down to `size`, so code which is kept
+		 * doesn't lose them.
+		 */
+		void truncate(size_t size)
+		{
+			auto& code = code_store.code;
+
+			// Each body is in a SkipBlock, [push end][jump][body...]
+			std::vector<MovedBlock> moved;
+			pcode::Offset end = size;
+			for(auto& patch : _lazy_patches)
+				{
+					auto stub = patch.stub;
+					if(patch.body < size || !_relocate(moved, size, stub))
+						{ continue; }
+
+					auto begin = patch.body - 3;
+					moved.push_back(MovedBlock{begin, code[begin + 1], end});
+					end += code[begin + 1] - begin;
+				}
+
+			for(auto& block : moved)
+				{ std::copy(code.begin() + block.begin, code.begin() + block.end, code.begin() + block.to); }
+
+			std::vector<size_t> relocations;
+			for(auto pos : code_store.relocations)
+				{
+					pcode::Offset moved_pos = pos;
+					if(!_relocate(moved, size, moved_pos))
+						{ continue; }
+
+					pcode::Offset address = code[moved_pos];
+					if(_relocate(moved, size, address, true))
+						{ code[moved_pos] = address; }
+					relocations.push_back(moved_pos);
+				}
+			std::sort(relocations.begin(), relocations.end());
+			code_store.relocations.swap(relocations);
+
+			for(auto itr = _lazy_patches.begin(); itr != _lazy_patches.end();)
+				{
+					if(_relocate(moved, size, itr->stub)
+					   && _relocate(moved, size, itr->body))
+						{
+							code[itr->stub + 1] = itr->body;
+							itr->metadata->body_address = itr->body;
+							++itr;
+						}
+					else
+						{ itr = _lazy_patches.erase(itr); }
+				}
+
+			code_store.resize(end);
+			for(auto itr = _specializations.begin(); itr != _specializations.end();)
+				{
+					if(_relocate(moved, size, itr->second))
+						{ ++itr; }
+					else
+						{ itr = _specializations.erase(itr); }
+				}
+		}
+
+		/** Compile the body of a lambda left as a lazy_compile stub
+		 * at the end of the code, and point the stub at it.
+		 *
+		 * @param metadata: the lambda, holding its lazy_body
+		 * @param stub: address of the stub
+		 * @return: address of the compiled body
+		 */
+		pcode::Offset compile_lazy_body(LambdaMetadata& metadata, pcode::Offset stub)
+		{
+			pcode::Offset address;
+			{
+				// The code may be run again from the top
+				SkipBlock my_def(assemble);
+				address = assemble.pos_end();
+
+				auto types = _formal_types(metadata);
+				Context body(&metadata, true);
+				body.param_types = &types;
+				body.body_address = address;
+
+				// Whatever the body gets compiled from, its
+				// definition's code now depends on
+				auto owner = _lazy_owners.find(&metadata);
+				auto outer_definition = _defining;
+				_defining = no_slot;
+				if(owner != _lazy_owners.end())
+					{ _defining = owner->second; }
+
+				auto body_expr = metadata.lazy_body;
+				try
+					{ _compile(body_expr, body); }
+				catch(...)
+					{
+						_defining = outer_definition;
+						throw;
+					}
+				_defining = outer_definition;
+				assemble.return_();
+			}
+
+			// [push metadata][lazy_compile] -> [push body][jump]
+			code_store.code[stub + 1] = address;
+			code_store.code[stub + 2] = vm_codes::Tag<vm_codes::jump>::value;
+			metadata.body_address = address;
+
+			_lazy_patches.push_back(LazyPatch{stub, address, &metadata});
+			return address;
+		}
+
 		void compile(Ast::iterator itr)
 		{ _compile(itr, Context(nullptr, false)); }
 
@@ -286,6 +1669,82 @@ namespace atl
 		void compile(Marked<Ast>&& ast)
 		{ compile(ast); }
 
+		/** Compile each of `forms` into its own segment and link the
+		 * segments onto code_store in order.  Forms must already be
+		 * annotated; compiling doesn't allocate from the GC, so the
+		 * segments can be generated on `threads` workers at once.
+		 * The workers don't write to anything the forms share; body
+		 * addresses and specialized copies are published as each
+		 * segment is linked.  (A segment may hold its own copy of a
+		 * specialization which was compiled before it.)
+		 *
+		 * @param forms: annotated top-level forms
+		 * @param threads: number of workers, 0 to use one per core
+		 */
+		void compile_segments(std::vector<Ast>& forms, size_t threads=0)
+		{
+			if(!threads)
+				{ threads = std::max(1u, std::thread::hardware_concurrency()); }
+			threads = std::min(threads, forms.size());
+
+			std::vector<Code> segments(forms.size());
+			std::vector<decltype(dependencies)> segment_dependencies(forms.size());
+			std::vector<decltype(_lazy_owners)> segment_owners(forms.size());
+			std::vector<decltype(_segment_bodies)> segment_bodies(forms.size());
+			std::vector<decltype(_specializations)> segment_specializations(forms.size());
+			std::vector<std::exception_ptr> errors(forms.size());
+			std::atomic<size_t> next(0);
+
+			auto worker = [&]()
+				{
+					for(size_t idx = next++; idx < forms.size(); idx = next++)
+						{
+							try
+								{
+									Compile segment(gc);
+									_copy_settings(segment);
+									segment._in_segment = true;
+									segment.compile(forms[idx]);
+									segments[idx] = std::move(segment.code_store);
+									segment_dependencies[idx] = std::move(segment.dependencies);
+									segment_owners[idx] = std::move(segment._lazy_owners);
+									segment_bodies[idx] = std::move(segment._segment_bodies);
+									segment_specializations[idx] = std::move(segment._specializations);
+								}
+							catch(...)
+								{ errors[idx] = std::current_exception(); }
+						}
+				};
+
+			std::vector<std::thread> workers;
+			for(size_t i = 1; i < threads; ++i)
+				{ workers.emplace_back(worker); }
+			worker();
+			for(auto& thread : workers)
+				{ thread.join(); }
+
+			for(auto& error : errors)
+				{ if(error) { std::rethrow_exception(error); } }
+
+			for(size_t idx = 0; idx < forms.size(); ++idx)
+				{
+					auto base = code_store.size();
+					code_store.link(segments[idx]);
+
+					for(auto& body : segment_bodies[idx])
+						{ body.first->body_address = body.second + base; }
+
+					// Keep the first copy of each specialization
+					for(auto& copy : segment_specializations[idx])
+						{ _specializations.emplace(copy.first, copy.second + base); }
+
+					for(auto& item : segment_dependencies[idx])
+						{ dependencies[item.first] = std::move(item.second); }
+					_lazy_owners.insert(segment_owners[idx].begin(), segment_owners[idx].end());
+				}
+			linked_segments += segments.size();
+		}
+
 		void dbg();
 	};
 
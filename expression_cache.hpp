@@ -0,0 +1,147 @@
+#ifndef ATL_EXPRESSION_CACHE_HPP
+#define ATL_EXPRESSION_CACHE_HPP
+/**
+ * @file /home/ryan/programming/atl/expression_cache.hpp
+ * @author Ryan Domigan <ryan_domigan@sutdents@uml.edu>
+ * Created on Oct 19, 2026
+ */
+
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "./byte_code.hpp"
+#include "./type.hpp"
+#include "./wrap.hpp"
+#include "gc/gc.hpp"
+
+namespace atl
+{
+	/** Compiled code for top level expressions, keyed by the shape
+	 * of the parsed (not yet annotated) Ast.  An entry is only good
+	 * while every global it depends on is at the version it was
+	 * compiled against.
+	 */
+	struct ExpressionCache
+		: public MarkBase
+	{
+		struct Entry
+		{
+			// Code compiled as though it started at 0
+			Code segment;
+			tag_t type;
+
+			// (slot, version) of each global the code depends on
+			std::vector<std::pair<size_t, size_t> > dependencies;
+
+			// The annotated expression; keeps the Strings and
+			// LambdaMetadata the code refers to alive.
+			Any annotated;
+		};
+
+		typedef std::unordered_map<std::string, Entry> Map;
+
+		Map entries;
+		size_t limit;
+
+		// Lookups which found usable code, and expressions which
+		// had to be compiled into the cache.
+		size_t hits, misses;
+
+		explicit ExpressionCache(GC& gc, size_t limit_=256)
+			: MarkBase(gc)
+			, limit(limit_)
+			, hits(0)
+			, misses(0)
+		{}
+
+		virtual void mark() override
+		{
+			for(auto& item : entries)
+				{ manage_marking.gc->mark(item.second.annotated); }
+		}
+
+		/** Serialize the structure of `ast` so equal expressions
+		 * get equal keys.  Symbols are keyed by name, Strings by
+		 * contents.
+		 *
+		 * @return: the key, or "" if `ast` holds something (like
+		 * quoted data) which shouldn't be cached.
+		 */
+		static std::string structural_key(Ast& ast)
+		{
+			std::string key;
+
+			auto text = [&](std::string const& value)
+				{
+					key.append(std::to_string(value.size()));
+					key.push_back(':');
+					key.append(value);
+				};
+
+			for(auto itr = ast.flat_begin(); itr != ast.flat_end(); ++itr)
+				{
+					key.append(std::to_string(itr->_tag));
+					key.push_back(' ');
+
+					switch(itr->_tag)
+						{
+						case tag<Symbol>::value:
+							text(unwrap<Symbol>(*itr).name);
+							break;
+						case tag<String>::value:
+							text(unwrap<String>(*itr).value);
+							break;
+						case tag<AstData>::value:
+						case tag<Fixnum>::value:
+						case tag<Bool>::value:
+						case tag<Null>::value:
+							key.append(std::to_string(reinterpret_cast<uintptr_t>(itr->value)));
+							break;
+						default:
+							return "";
+						}
+					key.push_back(' ');
+				}
+			return key;
+		}
+
+		/** Find the entry for `key` whose dependencies are all still
+		 * at the versions `version_of` reports.
+		 *
+		 * @return: the entry, or nullptr
+		 */
+		template<class VersionOf>
+		Entry* find(std::string const& key, VersionOf&& version_of)
+		{
+			auto found = entries.find(key);
+			if(found != entries.end())
+				{
+					for(auto& dep : found->second.dependencies)
+						{
+							if(version_of(dep.first) != dep.second)
+								{
+									entries.erase(found);
+									return nullptr;
+								}
+						}
+					++hits;
+					return &found->second;
+				}
+			return nullptr;
+		}
+
+		void insert(std::string const& key, Entry&& entry)
+		{
+			++misses;
+			if(entries.size() >= limit)
+				{ entries.clear(); }
+			entries[key] = std::move(entry);
+		}
+
+		void clear() { entries.clear(); }
+	};
+}
+
+#endif
@@ -13,6 +13,10 @@
 
 namespace atl
 {
+	// Pure primitives may be evaluated by the compiler when their
+	// arguments are constant.
+	enum class Purity { impure, pure };
+
 	struct PrimitiveDefiner
     {
 	    GC& gc;
@@ -25,11 +29,19 @@ namespace atl
 	    void macro(const std::string& name, CxxMacro::Fn fn)
         { env.define(name, wrap(new CxxMacro(fn, name))); }
 
+	    /** Define the primitive `name`.
+	     * @param instruction: VM instruction the compiler can use in
+	     *   place of calling `fn` on Fixnum arguments, 0 for none
+	     */
 	    template<class Sig>
 	    void function(std::string const& name,
-	                  typename signature::StdFunction<Sig>::type const& fn) {
-            env.define(name,
-                       signature::Wrapper<Sig>::type::a(fn, gc, name).any);
+	                  typename signature::StdFunction<Sig>::type const& fn,
+	                  Purity purity=Purity::impure,
+	                  tag_t instruction=0) {
+		    auto wrapped = signature::Wrapper<Sig>::type::a(fn, gc, name);
+		    wrapped->pure = (purity == Purity::pure);
+		    wrapped->native_instruction = instruction;
+            env.define(name, wrapped.any);
         }
 	};
 }
@@ -2,8 +2,14 @@
 #define ATL_GC_AST_POOL_HPP
 
 #include <atl/helpers/ast_access.hpp>
+#include <atl/gc/mark_stack.hpp>
 
+#include <algorithm>
 #include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 namespace atl
 {
@@ -31,6 +37,51 @@ namespace atl
 			size_t remaining() const { return _end - _itr; }
 		};
 
+		/** A Backer for the old generation.  Old Asts aren't moved by
+		 * a minor collection, so it remembers which ones have been
+		 * traced instead of forwarding them.
+		 */
+		struct OldBacker
+			: public Backer
+		{
+			// A byte per cell so parallel mark workers can test and
+			// set them atomically.
+			std::vector<unsigned char> traced;
+
+			OldBacker(size_t size) : Backer(size), traced(size, 0) {}
+
+			/// @return: true if `ast` had already been traced
+			bool trace(AstData* ast)
+			{
+				auto offset = reinterpret_cast<Any*>(ast) - _begin;
+				return __atomic_exchange_n(&traced[offset], 1, __ATOMIC_RELAXED);
+			}
+
+			void clear_traced() { traced.assign(traced.size(), 0); }
+
+			/// Was anything in this Backer traced?
+			bool any_traced() const
+			{ return std::find(traced.begin(), traced.end(), 1) != traced.end(); }
+
+			/** Bump allocate `size` cells; safe to race with other
+			 * claims.
+			 *
+			 * @return: the cells or nullptr if there isn't room
+			 */
+			Any* claim(size_t size)
+			{
+				auto itr = __atomic_load_n(&_itr, __ATOMIC_RELAXED);
+				do
+					{
+						if(static_cast<size_t>(_end - itr) < size)
+							{ return nullptr; }
+					}
+				while(!__atomic_compare_exchange_n(&_itr, &itr, itr + size, true,
+				                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+				return itr;
+			}
+		};
+
 		// Copies the src range to the 'end' pointer of some
 		// container, then moves the 'end' pointer the end of the copy
 		void copy_to_end(Range<Ast::flat_iterator>& src, Any*& end)
@@ -100,6 +151,24 @@ namespace atl
 		};
 	}
 
+	/** Asts are allocated from a young generation and promoted to an
+	 * old generation the first time they survive a collection, so
+	 * long lived Asts stop being copied by every collection.
+	 *
+	 * This isn't a generational collector in the usual sense: there's
+	 * no remembered set, so a minor collection still traces every
+	 * live old Ast (without copying it) to find what it refers to.
+	 * The pools sweep whatever that trace doesn't mark, so it can't
+	 * be skipped anyway.  What a minor collection saves is the
+	 * copying of the old Asts; see copied_cells.  Once the old
+	 * generation passes _old_limit the next collection is a major
+	 * one, which copies everything live into a fresh old generation.
+	 *
+	 * move and _trace may be called from several mark workers at
+	 * once: an Ast is claimed for copying by swapping its AstData tag
+	 * for Undefined, and the forwarding pointer is published by
+	 * setting the tag to MovedAstData.
+	 */
 	template<class Store> // template for mocking (requires 'mock(Any&)')
 	struct AstPool
 	{
@@ -114,10 +183,45 @@ namespace atl
 		// Fraction of pool which must be filled before we resize
 		constexpr static float RESIZE_THRESHOLD = 0.9;
 
+		// Young generation (backer) and the young space being
+		// collected (temp).
 		ast_pool_detail::Backer *backer, *temp;
+
+		// Young Backers which filled up while a collection couldn't
+		// run; they're collected with `backer` (and held in
+		// _overflow_from while that happens).
+		std::vector<ast_pool_detail::Backer*> _young_overflow, _overflow_from;
 		Store& store;
 		bool resize;
 
+		typedef ast_pool_detail::OldBacker OldBacker;
+		typedef std::vector<std::unique_ptr<OldBacker> > OldBackers;
+
+		// The old generation; promotions go to the back.  _old_from
+		// holds the old generation being evacuated by a major
+		// collection.
+		OldBackers _old, _old_from;
+
+		// Promotions which didn't fit the room gc_start left at the
+		// back of _old (only Asts from outside the pool should need
+		// it).  _old can't grow while it's being searched by other
+		// workers, so these join it in gc_finish.
+		OldBackers _old_spill;
+		std::mutex _spill_mutex;
+
+		// Asts reached by this collection whose items still need
+		// marking
+		MarkStack<Ast> _gray;
+
+		// Old generation size which triggers a major collection
+		size_t _old_limit;
+		bool _major;
+
+		// For GC telemetry: the cells the last collection evacuated
+		// from (the young generation, plus the old one if it was
+		// major) and the cells it copied.
+		size_t collected_cells, copied_cells;
+
 		typedef ast_pool_detail::AstBacker<AstPool> AstBacker;
 
 		// A list is the simplest way to keep pointers valid through add/remove
@@ -126,7 +230,11 @@ namespace atl
 
 		AstPool(Store& store_)
 			: store(store_),
-			  resize(false)
+			  resize(false),
+			  _old_limit(START_SIZE * 4),
+			  _major(false),
+			  collected_cells(0),
+			  copied_cells(0)
 		{
 			backer = new ast_pool_detail::Backer(START_SIZE);
 			temp = nullptr;
@@ -136,27 +244,109 @@ namespace atl
 		{
 			delete backer;
 			if(temp) { delete temp; }
+			for(auto young : _young_overflow) { delete young; }
+		}
+
+		size_t old_size() const
+		{
+			size_t counter = 0;
+			for(auto& old : _old)
+				{ counter += old->size(); }
+			return counter;
 		}
 
 		void gc_start()
 		{
+			auto old = old_size();
+
+			// Keep the young generation in proportion to the old one
+			// so the cost of tracing the old Asts stays amortized.
+			auto young = backer->size();
+			for(auto overflow : _young_overflow)
+				{ young += overflow->size(); }
+			_overflow_from.swap(_young_overflow);
+
 			temp = backer;
-			if(resize)
+			backer = new ast_pool_detail::Backer
+				(std::max(temp->reserved() * (resize ? RESIZE_FACTOR : 1),
+				          old / RESIZE_FACTOR));
+			resize = false;
+
+			_major = old > _old_limit;
+			collected_cells = young + (_major ? old : 0);
+			copied_cells = 0;
+
+			if(_major)
 				{
-					backer = new ast_pool_detail::Backer(temp->reserved() * RESIZE_FACTOR);
-					resize = false;
+					// Everything live in the old generation and the
+					// young space fits in one OldBacker.
+					std::swap(_old, _old_from);
+					_old.emplace_back(new OldBacker(old + young));
 				}
 			else
-				{ backer = new ast_pool_detail::Backer(temp->reserved()); }
+				{
+					for(auto& old : _old)
+						{ old->clear_traced(); }
+
+					// Make room for promoting every young Ast up front,
+					// so _promote never has to add to _old.
+					if(_old.empty() || _old.back()->remaining() < young)
+						{
+							_old.emplace_back
+								(new OldBacker(std::max(young, std::max(temp->reserved(),
+								                                        _old.empty() ? START_SIZE : _old.back()->reserved()))));
+						}
+				}
 		}
 
 		void gc_finish()
 		{
+			drain();
+
 			// If we're occupying more than the RESIZE_THRESHOLD of the
 			// reserved pool, we'll grow the pool next time around.
 			resize = (backer->reserved() * RESIZE_THRESHOLD) < backer->size();
 			delete temp;
 			temp = nullptr;
+
+			for(auto young : _overflow_from) { delete young; }
+			_overflow_from.clear();
+
+			for(auto& spill : _old_spill)
+				{ _old.insert(_old.end() - 1, std::move(spill)); }
+			_old_spill.clear();
+
+			// Old Backers which the collection didn't reach at all
+			// hold nothing but garbage, so they needn't wait for a
+			// major collection.
+			_old.erase(std::remove_if(_old.begin(), _old.end(),
+			                          [](std::unique_ptr<OldBacker> const& old)
+			                          { return !old->any_traced(); }),
+			           _old.end());
+
+			if(_major)
+				{
+					_old_from.clear();
+					_old_limit = std::max(START_SIZE * 4, old_size() * RESIZE_FACTOR);
+					_major = false;
+				}
+		}
+
+		/// \internal Make sure the young generation has `reserve`
+		/// free cells, collecting or (if the store can't collect right
+		/// now) starting a new young Backer.  Overflow Backers mean a
+		/// collection was put off, so it's asked for again until one
+		/// runs.
+		void _make_room(size_t reserve)
+		{
+			if(reserve > backer->remaining() || !_young_overflow.empty())
+				{ store.gc(); }
+
+			if(reserve > backer->remaining())
+				{
+					_young_overflow.push_back(backer);
+					backer = new ast_pool_detail::Backer(std::max(reserve, backer->reserved()));
+				}
 		}
 
 		// Move an AstBacker onto the 'backer' array, allocating
@@ -165,8 +355,7 @@ namespace atl
 		{
 			using namespace ast_pool_detail;
 
-			while(reserve > backer->remaining())
-				{ store.gc(); }
+			_make_room(reserve);
 
 			auto old = building;
 
@@ -211,8 +400,7 @@ namespace atl
 
 		typename AstBackers::iterator ast_backer(size_t initial_size)
 		{
-			while(initial_size > backer->remaining())
-				{ store.gc(); }
+			_make_room(initial_size);
 
 			_backers.emplace_front(unmarked_ast_backer(initial_size));
 			return _backers.begin();
@@ -227,51 +415,145 @@ namespace atl
 		void grow_ast_backer(AstBacker& ast)
 		{ move_ast_backer(ast, ast.reserved() * RESIZE_FACTOR); }
 
-		// Copy ast over to a new backer, but don't mark the the input
-		// as moved
-		Ast just_move(Ast& ast)
+		/// @return: the old generation OldBacker holding `pointer`, or nullptr
+		OldBacker* _old_backer(void* pointer)
+		{
+			for(auto& old : _old)
+				{
+					if(old->is_contained(pointer))
+						{ return old.get(); }
+				}
+			return nullptr;
+		}
+
+		/// \internal Claim `size` cells for a promotion (marked as
+		/// traced), spilling into _old_spill if the back of _old is
+		/// full.
+		Any* _claim_old(size_t size)
 		{
-			auto building = unmarked_ast_backer(ast.flat_size());
+			if(!_old.empty())
+				{
+					if(auto cells = _old.back()->claim(size))
+						{
+							_old.back()->trace(reinterpret_cast<AstData*>(cells));
+							return cells;
+						}
+				}
+
+			std::lock_guard<std::mutex> lock(_spill_mutex);
+			if(_old_spill.empty() || _old_spill.back()->remaining() < size)
+				{ _old_spill.emplace_back(new OldBacker(std::max(size, size_t(START_SIZE)))); }
 
-			Ast new_range(reinterpret_cast<AstData*>(building._itr));
-			ast_pool_detail::copy_to_end(flat_ast(ast), building._itr);
-			return new_range;
+			auto cells = _old_spill.back()->claim(size);
+			_old_spill.back()->trace(reinterpret_cast<AstData*>(cells));
+			return cells;
 		}
 
+		// Copy the `size` cells of 'ast' to the end of the old
+		// generation.  The copy's head gets the AstData tag back,
+		// since move has swapped the original's out.
+		Ast _promote(Ast& ast, size_t size)
+		{
+			auto cells = _claim_old(size);
+			__atomic_fetch_add(&copied_cells, size, __ATOMIC_RELAXED);
+			auto src = reinterpret_cast<Any*>(ast.value);
+			std::copy(src, src + size, cells);
+			cells->_tag = tag<AstData>::value;
+			return Ast(reinterpret_cast<AstData*>(cells));
+		}
 
-		// Copy 'ast' over to the new 'backer' array, and mark it's
-		// containedp items.  Ast's original AstData is invalidated,
-		// and used to store a pointer to its new location until the
-		// garbage collection finishes.
+		// Mark what `ast` refers to, moving any Asts it holds (which
+		// blackens `ast`).
+		void _trace(Ast ast)
+		{
+			for(auto& item : slice(flat_ast(ast), 1))
+				{
+					if(is<Ast>(item))
+						{ item = wrap(move(unwrap<Ast>(item))); }
+					else
+						{ store.mark(item); }
+				}
+		}
+
+		// Promote a young (or, during a major collection, old) 'ast'
+		// to the old generation, and shade it gray so its contained
+		// items get marked.  Ast's
+		// original AstData is invalidated, and used to store a
+		// pointer to its new location until the garbage collection
+		// finishes.  Asts already in the old generation stay put and
+		// are just traced.
 		Ast move(Ast ast)
 		{
 			if(backer->is_contained(ast.value))
 				{ return ast; }
 
-			if(ast.value->_tag == tag<MovedAstData>::value)
-				{ return Ast(reinterpret_cast<AstData*>(ast.value->value)); }
+			if(auto old = _old_backer(ast.value))
+				{
+					if(!old->trace(ast.value))
+						{ _gray.push(ast); }
+					return ast;
+				}
 
-			else
+			auto head = ast.value;
+			auto seen = __atomic_load_n(&head->_tag, __ATOMIC_ACQUIRE);
+			while(true)
 				{
-					auto new_ast = just_move(ast);
+					if(seen == tag<MovedAstData>::value)
+						{ return Ast(reinterpret_cast<AstData*>(head->value)); }
+
+					if(seen == tag<AstData>::value
+					   && __atomic_compare_exchange_n(&head->_tag, &seen, tag<Undefined>::value, false,
+					                                  __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+						{ break; }
+
+					// Another worker is copying it; wait for the
+					// forwarding pointer.
+					assert(seen == tag<Undefined>::value || seen == tag<AstData>::value);
+					std::this_thread::yield();
+					seen = __atomic_load_n(&head->_tag, __ATOMIC_ACQUIRE);
+				}
 
-					// store the location of the new copy to avoid re-copying
-					reinterpret_cast<Any*>(ast.value)->value = new_ast.value;
-					ast.value->_tag = tag<MovedAstData>::value;
+			auto new_ast = _promote(ast, head->flat_size());
 
-					for(auto& item : slice(flat_ast(new_ast), 1))
-						{
-							if(is<Ast>(item))
-								{ item = wrap(just_move(unwrap<Ast>(item))); }
-							else
-								{ store.mark(item); }
-						}
+			// store the location of the new copy to avoid re-copying
+			head->value = reinterpret_cast<size_t>(new_ast.value);
+			__atomic_store_n(&head->_tag, tag<MovedAstData>::value, __ATOMIC_RELEASE);
 
-					return new_ast;
-				}
+			_gray.push(new_ast);
+			return new_ast;
 		}
 
-		size_t size() const { return backer->size(); }
+		/** Trace one of the gray Asts (Asts in the old generation
+		 * which have been reached but whose contents haven't been
+		 * marked).
+		 *
+		 * @return: false if there were none
+		 */
+		bool scan_gray()
+		{
+			Ast ast;
+			if(!_gray.pop(ast)) { return false; }
+
+			_trace(ast);
+			_gray.done();
+			return true;
+		}
+
+		void drain() { while(scan_gray()); }
+
+		/// Cells in use by both generations (old garbage is only
+		/// dropped by a major collection)
+		/** Cells in use.  Dead Asts in the old generation are counted
+		 * until a collection finds their whole OldBacker dead, or a
+		 * major collection evacuates it.
+		 */
+		size_t size() const
+		{
+			size_t counter = backer->size() + old_size();
+			for(auto young : _young_overflow)
+				{ counter += young->size(); }
+			return counter;
+		}
 	};
 }
 
@@ -9,10 +9,13 @@
 
 #include <limits>
 #include <algorithm>
+#include <chrono>
 #include <functional>
 #include <list>
 #include <memory>
 #include <iterator>
+#include <thread>
+#include <vector>
 
 #include <boost/mpl/map.hpp>
 #include <boost/mpl/set.hpp>
@@ -31,6 +34,10 @@
 #include <atl/gc/ast_builder.hpp>
 #include <atl/gc/marked.hpp>
 #include <atl/gc/vm_closure.hpp>
+#include <atl/gc/pause_histogram.hpp>
+#include <atl/gc/mark_stack.hpp>
+#include <atl/gc/telemetry.hpp>
+#include <atl/gc/registry.hpp>
 
 namespace atl
 {
@@ -60,6 +67,45 @@ namespace atl
 			}
 		};
 
+		// Totals the pools' allocated and marked objects
+		struct Census
+		{
+			GC* gc;
+			size_t &allocated, &marked;
+
+			Census(GC *gc_, size_t& allocated_, size_t& marked_)
+				: gc(gc_), allocated(allocated_), marked(marked_) {}
+
+			template<class Mem>
+			void operator()(Mem const&)
+			{
+				auto &mem = gc->*Mem::value;
+				allocated += mem.num_allocated();
+				marked += mem.num_marked();
+			}
+		};
+
+		struct PoolCensus
+		{
+			GC* gc;
+			std::vector<PoolTelemetry>& pools;
+
+			PoolCensus(GC *gc_, std::vector<PoolTelemetry>& pools_) : gc(gc_), pools(pools_) {}
+
+			template<class Mem>
+			void operator()(Mem const&)
+			{
+				auto &mem = gc->*Mem::value;
+				auto allocated = mem.num_allocated();
+
+				pools.push_back
+					(PoolTelemetry{Name<typename Mem::Type>::value,
+						           allocated,
+						           mem.num_chunks() * mem.POOL_SIZE - allocated,
+						           mem.num_swept()});
+			}
+		};
+
 		struct Sweeper
 		{
 			GC* gc;
@@ -74,35 +120,95 @@ namespace atl
 			}
 		};
 
+		struct SweepSlice
+		{
+			GC* gc;
+			bool& swept;
+
+			SweepSlice(GC *gc_, bool& swept_) : gc(gc_), swept(swept_) {}
+
+			template<class Mem>
+			void operator()(Mem const&)
+			{
+				auto &mem = gc->*Mem::value;
+				swept = mem.sweep_slice() || swept;
+			}
+		};
+
+		struct FinishSweep
+		{
+			GC* gc;
+
+			FinishSweep(GC *gc_) : gc(gc_) {}
+
+			template<class Mem>
+			void operator()(Mem const&)
+			{
+				auto &mem = gc->*Mem::value;
+				mem.finish_sweep();
+			}
+		};
+
+		struct SweepConcurrently
+		{
+			GC* gc;
+
+			SweepConcurrently(GC *gc_) : gc(gc_) {}
+
+			template<class Mem>
+			void operator()(Mem const&)
+			{
+				auto &mem = gc->*Mem::value;
+				mem.sweep_concurrently();
+			}
+		};
+
+		struct SetSweepMode
+		{
+			GC* gc;
+			memory_pool::SweepMode mode;
+
+			SetSweepMode(GC *gc_, memory_pool::SweepMode mode_) : gc(gc_), mode(mode_) {}
+
+			template<class Mem>
+			void operator()(Mem const&)
+			{
+				auto &mem = gc->*Mem::value;
+				mem.sweep_mode = mode;
+			}
+		};
+
 		// Class needs to implement MarkBase to get marked by the GC
 		template<class GC>
 		struct MarkBase;
 
 		// Manage the lifespan of the GC's reference to a MarkBase
-		// instance.
+		// instance.  It's the GC's list node too, so registering
+		// doesn't allocate.
 		template<class GC>
 		struct ManageMarking
 		{
 			MarkBase<GC>* container;
 			GC* gc;
-			typename GC::MarkBaseList::iterator itr;
+
+			// Neighbours in GC::_mark_bases
+			ManageMarking *_prev, *_next;
 
 			ManageMarking(GC* gc_, MarkBase<GC>* container_)
 				: container(container_),
 				  gc(gc_)
-			{ itr = gc->add_mark_base(container); }
+			{ gc->_mark_bases.push_front(this); }
 
 			void drop()
 			{
-				if(gc) { gc->remove_mark_base(itr); }
+				if(gc) { gc->_mark_bases.erase(this); }
 			}
 
 			void take(ManageMarking&& other, MarkBase<GC>* container_)
 			{
 				container = container_;
 				gc = other.gc;
-				itr = other.itr;
-				*itr = container;
+				if(gc) { gc->_mark_bases.replace(&other, this); }
 				other.gc = nullptr;
 			}
 
@@ -148,8 +254,8 @@ namespace atl
 	{
 		typedef ::atl::gc_detail::MarkBase<GC> MarkBase;
 		typedef std::function<void (GC&)> MarkCallback;
-		typedef std::list<MarkCallback> RootsType;
-		typedef std::list<MarkBase*> MarkBaseList;
+		typedef CallbackTable<MarkCallback> RootsType;
+		typedef IntrusiveList<gc_detail::ManageMarking<GC> > MarkBaseList;
 
 
 		typedef ::atl::AstPool<GC> AstPool;
@@ -159,25 +265,17 @@ namespace atl
 
 		RootsType _roots;
 		MarkBaseList _mark_bases;
-		Marked<Any> *_cxx_stack;
+
+		// Slots of the Marked handles held by C++ code
+		HandleArena _handles;
 
 		// Adds callbacks which will be invoked during the mark phase of the GC.
 		// @param fn: the callback
-		RootsType::iterator add_marker(MarkCallback const& fn)
-		{
-			_roots.push_front(fn);
-			return _roots.begin();
-		}
+		// @return: the index to remove it by
+		size_t add_marker(MarkCallback const& fn)
+		{ return _roots.add(fn); }
 
-		void remove_marker(RootsType::iterator itr) { _roots.erase(itr); }
-
-		MarkBaseList::iterator add_mark_base(MarkBase* item)
-		{
-			_mark_bases.push_front(item);
-			return _mark_bases.begin();
-		}
-
-		void remove_mark_base(MarkBaseList::iterator itr) { _mark_bases.erase(itr); }
+		void remove_marker(size_t index) { _roots.remove(index); }
 
 		AstPool _ast_pool;
 		ClosurePool _closure_pool;
@@ -190,8 +288,70 @@ namespace atl
 
 		bool _gc_in_progress;
 
+		// While non-zero gc() does nothing, and the pools grow
+		// instead of collecting.
+		size_t _gc_deferred;
+
+		// A collection was asked for while they were deferred; it
+		// runs at the next allocation once they aren't.
+		bool _gc_pending;
+
+		// Might a pool have Chunks left to sweep (see sweep_slice)
+		bool _sweeping;
+
+		memory_pool::SweepMode _sweep_mode;
+
+		// With SweepMode::concurrent, sweeps what the last collection
+		// left while the program runs.  Joined before anything needs
+		// the pools settled (the next mark, or counting cells).
+		std::thread _sweeper;
+
+		// Length of each stop-the-world collection (marking, copying
+		// Asts and any eager sweep)
+		PauseHistogram collection_pauses;
+
+		// Length of each lazy sweep slice
+		PauseHistogram sweep_pauses;
+
+		// Time a sweep slice may take
+		PauseHistogram::Duration pause_budget;
+
+		GCTelemetry _telemetry;
+
+		// Threads which drain the gray objects (the collecting
+		// thread is one of them).
+		size_t mark_threads;
+
+		/** Put off collections for the guard's lifetime, so code
+		 * holding raw pointers into Asts (like the walkers used to
+		 * annotate and compile an expression) can allocate.  A
+		 * collection asked for meanwhile runs at the first allocation
+		 * after every DeferGC is gone.
+		 */
+		struct DeferGC
+		{
+			GC& gc;
+			DeferGC(GC& gc_) : gc(gc_) { ++gc._gc_deferred; }
+			~DeferGC() { --gc._gc_deferred; }
+		};
+
+		/** Compacts the Marked handles made in the guard's lifetime
+		 * when it ends, so ones released out of order don't leave
+		 * holes in the HandleArena.  Handles which outlive it are
+		 * kept.
+		 */
+		struct HandleScope
+		{
+			HandleArena& arena;
+			size_t watermark;
+
+			HandleScope(GC& gc) : arena(gc._handles), watermark(gc._handles.size()) {}
+			~HandleScope() { arena.compact(watermark); }
+		};
+
 		template< class T,  memory_pool::Pool<T> GC::*member >
 		struct MemberPtr {
+			typedef T Type;
 			typedef memory_pool::Pool<T> GC::* PoolType;
 			/* man this would be easier with inline definitions. */
 			const static PoolType value;
@@ -220,36 +380,68 @@ namespace atl
 		template<class T>
 		T* alloc_from(memory_pool::Pool<T> &pool)
 		{
+			if(_gc_pending && !_gc_deferred) { gc(); }
+			if(_sweeping) { sweep_slice(); }
+
 			auto result = pool.alloc();
 
+			// The pool has used the chunks it's allowed; collect,
+			// then grow if that didn't free anything.
 			if(result == nullptr) {
 				gc();
 				result = pool.alloc();
 				if(result == nullptr)
-					{ throw std::string("out of memory"); }
+					{ result = pool.grow(); }
 			}
 
 			return result;
 		}
 
-		GC() : _cxx_stack(nullptr), _ast_pool(*this), _gc_in_progress(false) {}
+		GC()
+			: _ast_pool(*this),
+			  _gc_in_progress(false),
+			  _gc_deferred(0),
+			  _gc_pending(false),
+			  _sweeping(false),
+			  _sweep_mode(memory_pool::SweepMode::eager),
+			  pause_budget(1000),
+			  mark_threads(1)
+		{}
+
+		~GC() { _join_sweeper(); }
+
+		void _join_sweeper()
+		{
+			if(_sweeper.joinable())
+				{ _sweeper.join(); }
+		}
 
 		// Mark everything the GC knows about.  This method was broken
 		// out for testing; use the 'gc()' method.
 		void _mark()
 		{
+			// A lazy or concurrent sweep may have left Chunks with
+			// last cycle's marks.
+			_join_sweeper();
+			auto finish = gc_detail::FinishSweep(this);
+			mpl::for_each
+				<PoolMap,
+				 typename mpl::lambda< mpl::value_type<PoolMap, mpl::_1 > >::type
+				 >(finish);
+
 			_ast_pool.gc_start();
 			_ast_pool.mark();
 
-			for(auto& i : _roots) { i(*this); }
-			for(auto& i : _mark_bases) { i->mark(); }
+			_roots(*this);
+			_mark_bases.for_each([](gc_detail::ManageMarking<GC>& item)
+			                     { item.container->mark(); });
 
-			auto marked = _cxx_stack;
-			while(marked)
+			for(auto handle : _handles.slots)
 				{
-					mark(marked->any);
-					marked = marked->_up;
+					if(handle) { mark(handle->any); }
 				}
+
+			_drain();
 		}
 
 		// Sweep marked objects.  This method was broken out for
@@ -264,46 +456,229 @@ namespace atl
 			_ast_pool.gc_finish();
 		}
 
+		/// Choose whether the pools sweep eagerly, as they're allocated from,
+		/// or on a sweeper thread.
+		void sweep_mode(memory_pool::SweepMode mode)
+		{
+			_join_sweeper();
+			_sweep_mode = mode;
+
+			auto set_mode = gc_detail::SetSweepMode(this, mode);
+			mpl::for_each
+				<PoolMap,
+				 typename mpl::lambda< mpl::value_type<PoolMap, mpl::_1 > >::type
+				 >(set_mode);
+		}
+
 		void gc()
 		{
+			if(_gc_deferred)
+				{
+					_gc_pending = true;
+					return;
+				}
+			_gc_pending = false;
+
 			assert(!_gc_in_progress);
+			auto start = std::chrono::steady_clock::now();
+			CollectionTelemetry collection;
+
 			_gc_in_progress = true;
 			_mark();
+			auto marked = std::chrono::steady_clock::now();
+
+			auto census = gc_detail::Census(this, collection.pool_allocated, collection.pool_marked);
+			mpl::for_each
+				<PoolMap,
+				 typename mpl::lambda< mpl::value_type<PoolMap, mpl::_1 > >::type
+				 >(census);
+			collection.ast_collected_cells = _ast_pool.collected_cells;
+			collection.ast_copied_cells = _ast_pool.copied_cells;
+			collection.ast_major = _ast_pool._major;
+
 			_sweep();
 			_gc_in_progress = false;
+			auto end = std::chrono::steady_clock::now();
+
+			using std::chrono::duration_cast;
+			collection.mark = duration_cast<CollectionTelemetry::Duration>(marked - start);
+			collection.sweep = duration_cast<CollectionTelemetry::Duration>(end - marked);
+			collection.pause = duration_cast<CollectionTelemetry::Duration>(end - start);
+			collection.ast_resize = _ast_pool.resize;
+			_telemetry.record(collection);
+
+			collection_pauses.record(end - start);
+
+			if(_sweep_mode == memory_pool::SweepMode::concurrent)
+				{
+					_sweeper = std::thread([this]()
+					                       {
+						                       auto sweeper = gc_detail::SweepConcurrently(this);
+						                       mpl::for_each
+							                       <PoolMap,
+							                        typename mpl::lambda< mpl::value_type<PoolMap, mpl::_1 > >::type
+							                        >(sweeper);
+					                       });
+				}
+			else if(_sweep_mode == memory_pool::SweepMode::lazy)
+				{ _sweeping = true; }
+		}
+
+		/** With SweepMode::lazy, sweep Chunks left by the last
+		 * collection until they're done or the pause_budget is used
+		 * up.  Called as things are allocated, so sweeping is spread
+		 * over small pauses.
+		 */
+		void sweep_slice()
+		{
+			auto start = std::chrono::steady_clock::now();
+			auto deadline = start + pause_budget;
+			bool swept, any = false;
+			auto slicer = gc_detail::SweepSlice(this, swept);
+
+			do
+				{
+					swept = false;
+					mpl::for_each
+						<PoolMap,
+						 typename mpl::lambda< mpl::value_type<PoolMap, mpl::_1 > >::type
+						 >(slicer);
+					any = any || swept;
+				}
+			while(swept && std::chrono::steady_clock::now() < deadline);
+
+			_sweeping = swept;
+			if(any)
+				{ sweep_pauses.record(std::chrono::steady_clock::now() - start); }
 		}
 
+		/// Is the `fraction` percentile of sweep slices within the
+		/// pause_budget?  The budget only bounds sweep slices;
+		/// collections mark everything reachable in one pause, which
+		/// is recorded in collection_pauses and isn't bounded.
+		bool within_budget(double fraction=0.99) const
+		{ return sweep_pauses.percentile(fraction) <= pause_budget; }
+
 		void mark(String& str)
 		{ _string_heap.mark(&str); }
 
-		void mark(CxxFunctor& functor)
+		// Marking is tri-color: an object is white until it's
+		// marked, gray while it's marked but on _gray waiting to have
+		// what it refers to marked, and black after _scan.
+		MarkStack<Any> _gray;
+
+		template<class T>
+		void _shade(memory_pool::Pool<T>& pool, T& object)
 		{
-			_primitive_recursive_heap.mark(&functor);
-			mark(functor.type);
+			if(pool.try_mark(&object))
+				{ _gray.push(Any(tag<T>::value, &object)); }
 		}
 
+		void mark(CxxFunctor& functor)
+		{ _shade(_primitive_recursive_heap, functor); }
+
 		void mark(Scheme& scheme)
 		{
-			_scheme_heap.mark(&scheme);
-			mark(scheme.type);
+			// Schemes can also live inside a Symbol (W returns those
+			// for a define); only pool cells have mark bits.
+			if(_scheme_heap.contains(&scheme))
+				{ _shade(_scheme_heap, scheme); }
+			else
+				{ mark(scheme.type); }
 		}
 
 		void mark(Symbol& sym)
+		{ _shade(_symbol_heap, sym); }
+
+		void mark(LambdaMetadata& metadata)
+		{ _shade(_lambda_metadata_heap, metadata); }
+
+		/// \internal Mark what a gray object refers to.
+		void _scan(Any& gray)
 		{
-			_symbol_heap.mark(&sym);
-			// The Scheme is on the Symbol, not the Scheme heap, so
-			// just check its type part.
-			mark(sym.scheme.type);
+			switch(gray._tag)
+				{
+				case tag<CxxFunctor>::value:
+					mark(unwrap<CxxFunctor>(gray).type);
+					break;
+
+				case tag<Scheme>::value:
+					mark(unwrap<Scheme>(gray).type);
+					break;
+
+				case tag<Symbol>::value:
+					// The Scheme is on the Symbol, not the Scheme
+					// heap, so just check its type part.
+					mark(unwrap<Symbol>(gray).scheme.type);
+					break;
+
+				case tag<LambdaMetadata>::value:
+					{
+						auto& metadata = unwrap<LambdaMetadata>(gray);
+						for(auto& item : metadata.closure)
+							{ mark(item); }
+
+						mark(metadata.formals);
+						mark(metadata.lazy_body);
+						break;
+					}
+				}
 		}
 
-		void mark(LambdaMetadata& metadata)
+		/// \internal Scan gray objects (and gray Asts) until there
+		/// aren't any, with mark_threads workers.  The roots have
+		/// already been shaded by the collecting thread.
+		void _drain()
 		{
-			_lambda_metadata_heap.mark(&metadata);
+			if(mark_threads < 2)
+				{
+					_mark_worker();
+					return;
+				}
+
+			MarkWork work(0);
+			_gray.start_parallel(mark_threads, work);
+			_ast_pool._gray.start_parallel(mark_threads, work);
+
+			std::vector<std::thread> workers;
+			for(size_t id = 1; id < mark_threads; ++id)
+				{
+					workers.emplace_back([this, id, &work]()
+					                     {
+						                     mark_worker() = id;
+						                     _mark_worker(&work);
+					                     });
+				}
+			_mark_worker(&work);
 
-			for(auto& item : metadata.closure)
-				{ mark(item); }
+			for(auto& worker : workers)
+				{ worker.join(); }
 
-			mark(metadata.formals);
+			_gray.stop_parallel();
+			_ast_pool._gray.stop_parallel();
+		}
+
+		/** \internal Scan gray objects until they're all black.  In
+		 * parallel, an empty stack only means this worker is done
+		 * once no other worker is scanning something which might
+		 * shade more.
+		 */
+		void _mark_worker(MarkWork* work=nullptr)
+		{
+			Any gray;
+			while(true)
+				{
+					if(_gray.pop(gray))
+						{
+							_scan(gray);
+							_gray.done();
+						}
+					else if(!_ast_pool.scan_gray())
+						{
+							if(!work || !*work) { return; }
+							std::this_thread::yield();
+						}
+				}
 		}
 
 		void mark(Ast& ast)
@@ -374,20 +749,20 @@ namespace atl
 		template<class Type, class ... Types>
 		Marked<Type> make(Types ... args)
 		{
-			return Marked<Type>(_cxx_stack,
+			return Marked<Type>(_handles,
 			                    Any(tag<Type>::value,
 			                        raw_make<Type>(unpack_marked(args)...)));
 		}
 
 		template<class T>
 		Marked<T> marked(T& thing)
-		{ return Marked<T>(_cxx_stack, thing); }
+		{ return Marked<T>(_handles, thing); }
 
 		Marked<Ast> marked(Ast thing)
-		{ return Marked<Ast>(_cxx_stack, wrap(thing)); }
+		{ return Marked<Ast>(_handles, wrap(thing)); }
 
 		Marked<Any> marked(Any thing)
-		{ return Marked<Any>(_cxx_stack, thing); }
+		{ return Marked<Any>(_handles, thing); }
 
 		AstBuilder ast_builder()
 		{ return AstBuilder(_ast_pool, _ast_pool.ast_backer()); }
@@ -406,11 +781,29 @@ namespace atl
 		{
 			auto ast = ast_builder();
 			func(ast);
-			return Marked<Ast>(_cxx_stack, ast.built());
+			return Marked<Ast>(_handles, ast.built());
+		}
+
+		/** Counters from the collections so far, plus the current
+		 * occupancy of each pool.
+		 */
+		GCTelemetry const& telemetry()
+		{
+			_join_sweeper();
+
+			_telemetry.pools.clear();
+			auto census = gc_detail::PoolCensus(this, _telemetry.pools);
+			mpl::for_each
+				<PoolMap,
+				 typename mpl::lambda< mpl::value_type<PoolMap, mpl::_1 > >::type
+				 >(census);
+			return _telemetry;
 		}
 
 		size_t cells_allocated()
 		{
+			_join_sweeper();
+
 			size_t count = 0;
 			auto counter = gc_detail::Counter(this, count);
 			mpl::for_each
@@ -425,6 +818,14 @@ namespace atl
 		                           size_t formals,
 		                           size_t captures)
 		{ return _closure_pool.closure(body_location, formals, captures); }
+
+		// Adds callbacks which mark the closures a range of VM words
+		// refers to (see ClosurePool::mark_range).
+		size_t add_closure_root(ClosurePool::MarkCallback const& fn)
+		{ return _closure_pool.add_root(fn); }
+
+		void remove_closure_root(size_t index)
+		{ _closure_pool.remove_root(index); }
 	};
 
 	template< class T,	memory_pool::Pool<T> GC::*member >
@@ -0,0 +1,140 @@
+#ifndef ATL_GC_MARK_STACK_HPP
+#define ATL_GC_MARK_STACK_HPP
+/**
+ * @file /home/ryan/programming/atl/gc/mark_stack.hpp
+ * @author Ryan Domigan <ryan_domigan@sutdents@uml.edu>
+ * Created on Oct 19, 2026
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace atl
+{
+	/** Gray objects pushed but not yet scanned, counted across all
+	 * the MarkStacks of a parallel mark.  Marking is finished once
+	 * it's back to zero.
+	 */
+	typedef std::atomic<long> MarkWork;
+
+	/// Index of the calling thread's deque in each MarkStack (0 off
+	/// the mark workers).
+	inline size_t& mark_worker()
+	{
+		static thread_local size_t worker = 0;
+		return worker;
+	}
+
+	/** Gray list for the mark phase.  Normally it's just a stack; during
+	 * a parallel mark each worker pushes and pops at the back of its
+	 * own deque and, when that runs dry, steals from the front of
+	 * the others'.
+	 */
+	template<class T>
+	struct MarkStack
+	{
+		struct Deque
+		{
+			std::mutex mutex;
+			std::deque<T> items;
+		};
+
+		std::vector<std::unique_ptr<Deque> > _deques;
+		MarkWork* _work;
+
+		MarkStack() : _work(nullptr)
+		{ _deques.emplace_back(new Deque); }
+
+		bool parallel() const { return _work != nullptr; }
+
+		/** Give each of `workers` threads a deque; the items already
+		 * pushed stay on worker 0's and get counted towards `work`.
+		 */
+		void start_parallel(size_t workers, MarkWork& work)
+		{
+			while(_deques.size() < workers)
+				{ _deques.emplace_back(new Deque); }
+
+			for(auto& deque : _deques)
+				{ work += deque->items.size(); }
+			_work = &work;
+		}
+
+		void stop_parallel() { _work = nullptr; }
+
+		void push(T const& item)
+		{
+			if(!parallel())
+				{
+					_deques[0]->items.push_back(item);
+					return;
+				}
+
+			auto& deque = *_deques[mark_worker()];
+			std::lock_guard<std::mutex> lock(deque.mutex);
+			deque.items.push_back(item);
+			++*_work;
+		}
+
+		/** In parallel, the caller has to call `done` once it's
+		 * finished with the popped item.
+		 *
+		 * @return: false if there was nothing to pop (or steal)
+		 */
+		bool pop(T& item)
+		{
+			if(!parallel())
+				{
+					auto& items = _deques[0]->items;
+					if(items.empty()) { return false; }
+
+					item = items.back();
+					items.pop_back();
+					return true;
+				}
+
+			auto self = mark_worker();
+			{
+				auto& deque = *_deques[self];
+				std::lock_guard<std::mutex> lock(deque.mutex);
+				if(!deque.items.empty())
+					{
+						item = deque.items.back();
+						deque.items.pop_back();
+						return true;
+					}
+			}
+
+			for(size_t i = 1; i < _deques.size(); ++i)
+				{
+					auto& victim = *_deques[(self + i) % _deques.size()];
+					std::lock_guard<std::mutex> lock(victim.mutex);
+					if(!victim.items.empty())
+						{
+							item = victim.items.front();
+							victim.items.pop_front();
+							return true;
+						}
+				}
+			return false;
+		}
+
+		void done() { if(_work) { --*_work; } }
+
+		bool empty() const
+		{
+			for(auto& deque : _deques)
+				{
+					if(!deque->items.empty())
+						{ return false; }
+				}
+			return true;
+		}
+	};
+}
+
+#endif
@@ -1,21 +1,51 @@
 #ifndef ATL_GC_MARKED_HPP
 #define ATL_GC_MARKED_HPP
 
+#include <vector>
+
 namespace atl
 {
 	struct GC;
 	typedef std::function<void (GC&)> MarkCallback;
 
-	// The purpose of the Marked structs is to maintain a singly
-	// linked list on the call stack.  The idea is that some function
-	// like GC::make returns a Marked instance which is not part of
-	// the list.  The function receiving this initializes or assigns
-	// its own the Marked using either the move assign or construct,
-	// so it's the move assign/construct methods which actually tie
-	// the instance to the GC mark.
+	// A Marked instance keeps what it holds alive by having a slot in
+	// the GC's HandleArena.  Some function like GC::make returns a
+	// Marked, and the function receiving it move constructs or
+	// assigns its own, which takes over the slot.
 	template<class T>
 	struct Marked;
 
+	/** The slots of the live Marked handles, in one contiguous array
+	 * the GC scans linearly.  Handles mostly die in the reverse of
+	 * the order they were made, so releasing the top slot pops it.  One
+	 * released out of order leaves a hole, which goes once the slots
+	 * above it have, or when the enclosing HandleScope closes.
+	 */
+	struct HandleArena
+	{
+		std::vector<Marked<Any>*> slots;
+
+		size_t push(Marked<Any>* handle)
+		{
+			slots.push_back(handle);
+			return slots.size() - 1;
+		}
+
+		void release(size_t slot)
+		{
+			slots[slot] = nullptr;
+			while(!slots.empty() && !slots.back())
+				{ slots.pop_back(); }
+		}
+
+		/// Drop the holes above `watermark`, moving the live handles
+		/// down.
+		void compact(size_t watermark);
+
+		/// Number of slots in use, holes included
+		size_t size() const { return slots.size(); }
+	};
+
 	// Add a base so I can use std::is_base to check if something is
 	// Marked
 	struct MarkedBase {};
@@ -23,70 +53,52 @@ namespace atl
 	template<>
 	struct Marked<Any> : public MarkedBase
 	{
-		Marked** _top;
-		Marked *_up;
+		// The arena this has a slot in, or nullptr if it doesn't own one
+		HandleArena* _arena;
+		size_t _slot;
 		Any any;
-		bool _owner;
 
 		typedef Any value_type;
 
 		void _pop()
 		{
-			if(_owner)
-				{
-					// so; we should mostly be popping from the top,
-					// or close to the top, since a given frame should
-					// only have a couple of Marked locals
-					if(*_top == this)
-						{ *_top = _up; }
-					else
-						{
-							auto top = *_top;
-							while(top)
-								{
-									if(top->_up == this)
-										{
-											top->_up = _up;
-											break;
-										}
-									else
-										{ top = top->_up; }
-								}
-						}
-				}
+			if(_arena) { _arena->release(_slot); }
 
 			any = wrap<Null>();
-			_owner = false;
-			_up = nullptr;
+			_arena = nullptr;
 		}
 
+		// Take over other's slot
 		void _move(Marked&& other)
 		{
-			_top = other._top;
+			_arena = other._arena;
+			_slot = other._slot;
 			any = other.any;
-			_owner = other._owner;
 
-			other._pop();
+			if(_arena) { _arena->slots[_slot] = this; }
 
-			_up = *_top;
-			*_top = this;
+			other._arena = nullptr;
+			other.any = wrap<Null>();
 		}
 
 		Marked()
-			: _top(nullptr), _up(nullptr), any(wrap<Null>()), _owner(false)
+			: _arena(nullptr), _slot(0), any(wrap<Null>())
 		{}
 
-		Marked(Marked*& top, Any const& any_)
-			: _top(&top), _up(*_top), any(any_), _owner(true)
-		{ *_top = this; }
+		Marked(HandleArena& arena, Any const& any_)
+			: _arena(&arena), any(any_)
+		{ _slot = arena.push(this); }
 
 		Marked(Marked&& other)
 		{ _move(std::move(other)); }
 
 		Marked& operator=(Marked&& other)
 		{
-			_pop();
-			_move(std::move(other));
+			if(this != &other)
+				{
+					_pop();
+					_move(std::move(other));
+				}
 			return *this;
 		}
 
@@ -106,7 +118,7 @@ namespace atl
 
 		Marked() : MarkedBase() {}
 
-		Marked(MarkedBase*& top, Any const& any) : MarkedBase(top, any) {}
+		Marked(HandleArena& arena, Any const& any) : MarkedBase(arena, any) {}
 
 		Marked(Marked&& other) : MarkedBase(std::move(other)) {}
 
@@ -117,8 +129,7 @@ namespace atl
 
 		Marked& operator=(Marked&& other)
 		{
-			_pop();
-			MarkedBase::_move(std::move(other));
+			MarkedBase::operator=(std::move(other));
 			return *this;
 		}
 
@@ -126,6 +137,22 @@ namespace atl
 		{ return Marked<Any>(std::move(*this)); }
 	};
 
+	inline void HandleArena::compact(size_t watermark)
+	{
+		if(watermark >= slots.size()) { return; }
+
+		auto keep = watermark;
+		for(auto itr = slots.begin() + watermark; itr != slots.end(); ++itr)
+			{
+				if(auto handle = *itr)
+					{
+						handle->_slot = keep;
+						slots[keep++] = handle;
+					}
+			}
+		slots.resize(keep);
+	}
+
 	// Return the value a Marked<..> is wrapping, or pass a value
 	// through if it's not a Marked<..>.
 	template<class T, bool is_marked=std::is_base_of<MarkedBase, T>::value>
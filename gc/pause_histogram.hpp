@@ -0,0 +1,77 @@
+#ifndef ATL_GC_PAUSE_HISTOGRAM_HPP
+#define ATL_GC_PAUSE_HISTOGRAM_HPP
+/**
+ * @file /home/ryan/programming/atl/gc/pause_histogram.hpp
+ * @author Ryan Domigan <ryan_domigan@sutdents@uml.edu>
+ * Created on Oct 19, 2026
+ */
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+
+namespace atl
+{
+	/** Counts GC pauses in power of two microsecond buckets: bucket
+	 * 0 holds pauses under 1us, bucket N those from 2^(N-1) up to
+	 * 2^N us.
+	 */
+	struct PauseHistogram
+	{
+		typedef std::chrono::microseconds Duration;
+
+		static const size_t BUCKETS = 32;
+
+		std::array<size_t, BUCKETS> buckets;
+		size_t count;
+		Duration longest;
+
+		PauseHistogram() { clear(); }
+
+		void clear()
+		{
+			buckets.fill(0);
+			count = 0;
+			longest = Duration(0);
+		}
+
+		static size_t bucket_of(Duration pause)
+		{
+			size_t bucket = 0;
+			for(auto us = pause.count(); us > 0 && bucket < BUCKETS - 1; us >>= 1)
+				{ ++bucket; }
+			return bucket;
+		}
+
+		/// Longest pause bucket `bucket` can hold
+		static Duration bucket_limit(size_t bucket)
+		{ return Duration((Duration::rep(1) << bucket) - 1); }
+
+		template<class Rep, class Period>
+		void record(std::chrono::duration<Rep, Period> pause)
+		{
+			auto us = std::chrono::duration_cast<Duration>(pause);
+			++buckets[bucket_of(us)];
+			++count;
+			if(us > longest) { longest = us; }
+		}
+
+		/** @return: a bound on the pause time which `fraction` (like
+		 * 0.99) of the recorded pauses are within.
+		 */
+		Duration percentile(double fraction) const
+		{
+			size_t seen = 0;
+			for(size_t bucket = 0; bucket < BUCKETS; ++bucket)
+				{
+					seen += buckets[bucket];
+					if(seen && seen >= fraction * count)
+						{ return std::min(bucket_limit(bucket), longest); }
+				}
+			return longest;
+		}
+	};
+}
+
+#endif
@@ -1,7 +1,12 @@
 #ifndef ATL_GC_POOL_HPP
 #define ATL_GC_POOL_HPP
 
+#include <cassert>
 #include <limits>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
 #include <atl/debug.hpp>
 
 namespace atl
@@ -21,6 +26,31 @@ namespace atl
 			return _log_of_power2(value - 1);
 		}
 
+		/** How Pool::sweep reclaims unmarked items.
+		 *
+		 * eager: every Chunk is swept when the GC sweeps.
+		 *
+		 * lazy: sweeping just flags each Chunk, which is then swept
+		 * the next time alloc wants to use it (or before the next mark
+		 * phase, by finish_sweep).
+		 *
+		 * concurrent: like lazy, but a sweeper thread works through
+		 * the flagged Chunks (with sweep_concurrently) while the
+		 * program keeps allocating; whichever of the sweeper or alloc
+		 * gets to a Chunk first sweeps it.
+		 */
+		enum class SweepMode { eager, lazy, concurrent };
+
+		/// Number of set bits in `bits`
+		template<class Bits>
+		unsigned int popcount(Bits bits)
+		{ return __builtin_popcountll(static_cast<unsigned long long>(bits)); }
+
+		/// Index of the lowest set bit in (non-zero) `bits`
+		template<class Bits>
+		unsigned int lowest_bit(Bits bits)
+		{ return __builtin_ctzll(static_cast<unsigned long long>(bits)); }
+
 		template<class T,
 		         // The allocated/marked bits are masked onto integral
 		         // type Bits.  These are template parameters so small
@@ -33,199 +63,554 @@ namespace atl
 			static_assert(std::is_unsigned<Bits>::value,
 			              "Pool's Bits type must be unsigned");
 
-			// Number of Bits fields it would take to annotate the
-			// array of T[_size].
+			// Each item has an allocated bit (so we can tell if
+			// something needs to be swept/destructed) and a mark bit.
+			// They live in separate bitmaps, so the sweep can find
+			// a field's worth of garbage with `alloc & ~mark`.
 			//
-			// We two bits per item because we need to track if it's
-			// alloated or free (so we can tell if something needs to
-			// be swept/destructed) and a mark bit.
+			// POOL_SIZE is the number of items in one Chunk; the
+			// Pool adds Chunks as it needs them.
 			static const size_t POOL_SIZE = _POOL_SIZE;
-			static_assert
-			(((POOL_SIZE % (sizeof(Bits) << 1)) == 0),
-			 "THe bit-size of the Bits field should divide evenly into the Pool size");
 
 			static const size_t FIELD_SIZE = std::numeric_limits<Bits>::digits;
 
-			// Number of alloc/mark pairs a Bits field can hold
-			static const size_t BITS_SIZE = FIELD_SIZE >> 1;
+			static_assert
+			(((POOL_SIZE % FIELD_SIZE) == 0),
+			 "THe bit-size of the Bits field should divide evenly into the Pool size");
 
-			// number of bits it takes to address each alloc/mark pair
-			// of bit in Bits
-			static const size_t BITS_ADDRESS_SIZE = log_of_power2(BITS_SIZE);
+			// number of bits it takes to address each bit of Bits
+			static const size_t BITS_ADDRESS_SIZE = log_of_power2(FIELD_SIZE);
 
-			static const size_t FIELDS = (POOL_SIZE / BITS_SIZE);
+			// Number of Bits fields in each bitmap
+			static const size_t FIELDS = (POOL_SIZE / FIELD_SIZE);
 
 			// If I want the bits for a particular item in my Pool,
 			// given its offset, I need to right shift the offset by
 			// INDEX_PART_SHIFT to determine the appropriate index
-			// into the bits array, and apply the FIELD_PART_MASK to
-			// the offset to get the particular bits of interest
-			// within the value at the index.
+			// into the bitmaps, and apply the FIELD_PART_MASK to the
+			// offset to get the particular bit of interest within the
+			// value at the index.
 			static const Bits INDEX_PART_SHIFT = BITS_ADDRESS_SIZE;
 			static const Bits FIELD_PART_MASK = std::numeric_limits<Bits>::max() >> (FIELD_SIZE - BITS_ADDRESS_SIZE);
 
-			// Get the mask for the offset's mark bit in a field.
-			static Bits _mark_bit(Bits offset)
-			{ return (Bits)2 << ((FIELD_PART_MASK & offset) << (Bits)1); }
+			// Get the mask for the offset's bit in its field of
+			// either bitmap.
+			static Bits _bit(Bits offset)
+			{ return (Bits)1 << (FIELD_PART_MASK & offset); }
 
-			static Bits _alloc_bit(Bits offset)
-			{ return (Bits)1 << ((FIELD_PART_MASK & offset) << (Bits)1); }
-
-			// Get the index of the field the offset's mark is in.
+			// Get the index of the field the offset's bits are in.
 			static size_t _field(Bits offset)
 			{ return offset >> INDEX_PART_SHIFT; }
 
-			bool is_marked(size_t offset)
-			{ return _bits[_field(offset)] & _mark_bit(offset); }
+			static_assert(sizeof(T) >= sizeof(void*), "Can't build a pool _free list of types sized < void*");
 
-			bool is_allocated(size_t offset)
-			{ return _bits[_field(offset)] & _alloc_bit(offset); }
+			/** POOL_SIZE items with their own alloc/mark bitmaps and
+			 * free list.
+			 */
+			struct Chunk
+			{
+				Bits _alloc[FIELDS], _mark[FIELDS];
 
-			bool set_mark(size_t offset)
-			{ return _bits[_field(offset)] |= _mark_bit(offset); }
+				T *_begin, *_itr, *_end, *_free;
 
-			bool unset_mark(size_t offset)
-			{ return _bits[_field(offset)] &= ~_mark_bit(offset); }
+				// Number of allocated items (including garbage an
+				// unswept Chunk hasn't freed yet)
+				size_t _allocated;
 
-			bool set_allocated(size_t offset)
-			{ return _bits[_field(offset)] |= _alloc_bit(offset); }
+				// Is this Chunk on its Pool's _available list
+				bool _available;
 
-			bool set_allocated(T* pointer)
-			{ return set_allocated(pointer - _begin); }
+				// SWEPT, UNSWEPT (marked but not swept, see
+				// SweepMode::lazy) or SWEEPING.  Changed atomically,
+				// since a concurrent sweeper may be after the Chunk
+				// too.
+				unsigned char _sweep_state;
 
-			bool unset_allocated(size_t offset)
-			{ return _bits[_field(offset)] &= ~_alloc_bit(offset); }
+				static const unsigned char SWEPT = 0, UNSWEPT = 1, SWEEPING = 2;
 
-			bool is_marked(T* pointer)
-			{ return is_marked(pointer - _begin); }
+				bool is_marked(size_t offset)
+				{ return _mark[_field(offset)] & _bit(offset); }
 
-			bool is_allocated(T* pointer)
-			{ return is_allocated(pointer - _begin); }
+				bool is_allocated(size_t offset)
+				{ return _alloc[_field(offset)] & _bit(offset); }
 
+				// Atomic so parallel mark workers can share a Chunk.
+				void set_mark(size_t offset)
+				{ __atomic_fetch_or(&_mark[_field(offset)], _bit(offset), __ATOMIC_RELAXED); }
 
-			// used to hold a mark/unmarked bit and a allocated/free bit
-			Bits _bits[FIELDS];
+				/// @return: true if this call set the mark
+				bool try_mark(size_t offset)
+				{
+					auto bit = _bit(offset);
+					return !(__atomic_fetch_or(&_mark[_field(offset)], bit, __ATOMIC_RELAXED) & bit);
+				}
 
-			T *_begin, *_itr, *_end, *_free;
+				void unset_mark(size_t offset)
+				{ _mark[_field(offset)] &= ~_bit(offset); }
 
-			static_assert(sizeof(T) >= sizeof(void*), "Can't build a pool _free list of types sized < void*");
+				void set_allocated(size_t offset)
+				{ _alloc[_field(offset)] |= _bit(offset); }
+
+				void unset_allocated(size_t offset)
+				{ _alloc[_field(offset)] &= ~_bit(offset); }
+
+				Chunk() : _free(nullptr), _allocated(0), _available(false), _sweep_state(SWEPT)
+				{
+					/* allocate chars since I don't want T's constructor called on the elements */
+					_itr = _begin = (T*) new char[sizeof(T) * POOL_SIZE];
+					_end = _itr + POOL_SIZE;
+
+					for(unsigned int i = 0; i < FIELDS; ++i)
+						{ _alloc[i] = _mark[i] = 0; }
+				}
+
+				~Chunk()
+				{
+					// Destruct anything that's not free
+					for(size_t i = 0; i < FIELDS; ++i)
+						{
+							for(auto live = _alloc[i]; live; live &= live - 1)
+								{ _begin[(i << INDEX_PART_SHIFT) + lowest_bit(live)].~T(); }
+						}
+
+					delete[] (char*)_begin;
+				}
+
+				bool full() const { return (_free == nullptr) && (_itr == _end); }
+				bool empty() const { return _allocated == 0; }
+
+				T* alloc()
+				{
+					finish_sweep();
+
+					T *tmp;
+					if(_free != nullptr)
+						{
+							tmp = _free;
+							_free = *reinterpret_cast<T**>(_free);
+						}
+
+					else if(_itr != _end)
+						tmp = _itr++;
+
+					else
+						return nullptr;
+
+					set_allocated(tmp - _begin);
+					++_allocated;
+					return tmp;
+				}
+
+				void free(T* pointer)
+				{
+					auto offset = pointer - _begin;
+					pointer->~T();	  // call the destructor
+					unset_allocated(offset);
+					unset_mark(offset);
+					--_allocated;
+
+					if((pointer + 1) == _itr)
+						{ --_itr; }
+					else {
+						*reinterpret_cast<T**>(pointer) = _free;
+						_free = pointer;
+					}
+				}
+
+				bool unswept() const
+				{ return __atomic_load_n(&_sweep_state, __ATOMIC_ACQUIRE) != SWEPT; }
+
+				void flag_unswept()
+				{ __atomic_store_n(&_sweep_state, UNSWEPT, __ATOMIC_RELEASE); }
+
+				/** Sweep the Chunk if it's been flagged, or wait if
+				 * another thread is sweeping it.
+				 *
+				 * @return: number of items freed by this call
+				 */
+				unsigned int finish_sweep()
+				{
+					auto state = __atomic_load_n(&_sweep_state, __ATOMIC_ACQUIRE);
+					if(state == SWEPT) { return 0; }
+
+					if(state == UNSWEPT
+					   && __atomic_compare_exchange_n(&_sweep_state, &state, SWEEPING, false,
+					                                  __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+						{ return sweep(); }
+
+					while(unswept())
+						{ std::this_thread::yield(); }
+					return 0;
+				}
+
+				/** Free everything allocated but not marked, a field at a
+				 * time, and clear the marks.
+				 */
+				unsigned int sweep()
+				{
+					unsigned int swept = 0;
+
+					for(size_t i = 0; i < FIELDS; ++i)
+						{
+							auto garbage = _alloc[i] & ~_mark[i];
+							_mark[i] = 0;
+
+							if(!garbage) { continue; }
+
+							_alloc[i] &= ~garbage;
+							swept += popcount(garbage);
+
+							for(; garbage; garbage &= garbage - 1)
+								{
+									auto pointer = _begin + (i << INDEX_PART_SHIFT) + lowest_bit(garbage);
+									pointer->~T();
+									*reinterpret_cast<T**>(pointer) = _free;
+									_free = pointer;
+								}
+						}
+
+					_allocated -= swept;
+					if(!_allocated)
+						{
+							_free = nullptr;
+							_itr = _begin;
+						}
+
+					__atomic_store_n(&_sweep_state, SWEPT, __ATOMIC_RELEASE);
+					return swept;
+				}
+
+				size_t num_free() const
+				{
+					size_t counter = 0;
+					auto itr = _free;
+					while(itr)
+						{
+							++counter;
+							itr = *reinterpret_cast<T**>(itr);
+						}
+					return counter;
+				}
+			};
+
+			SweepMode sweep_mode;
+
+			// _chunks[0] is never released, so _begin and the
+			// offset based accessors always refer to it.
+			std::vector<std::unique_ptr<Chunk> > _chunks;
+
+			// Chunks keyed by their _end, for finding the Chunk a
+			// pointer belongs to.
+			std::map<T*, Chunk*> _by_end;
+
+			// Chunks with room to allocate from; alloc takes from the
+			// back.
+			std::vector<Chunk*> _available;
+
+			// Number of Chunks alloc may use before it asks for a
+			// collection (by returning nullptr).
+			size_t _chunk_limit;
+
+			// Next Chunk for sweep_slice to look at
+			size_t _sweep_cursor;
+
+			// The Chunks flagged by a concurrent sweep.  The sweeper
+			// works from this copy since alloc may add to _chunks
+			// meanwhile.
+			std::vector<Chunk*> _unswept_chunks;
+
+			// Items freed by sweeping, over the Pool's life (added to
+			// by the sweeper thread too).
+			size_t _swept;
+
+			T *_begin;
+
+			Pool(SweepMode mode=SweepMode::eager)
+				: sweep_mode(mode)
+				, _chunk_limit(1)
+				, _sweep_cursor(0)
+				, _swept(0)
+			{ _begin = _add_chunk()->_begin; }
+
+			unsigned int _count_swept(unsigned int swept)
+			{
+				if(swept) { __atomic_fetch_add(&_swept, swept, __ATOMIC_RELAXED); }
+				return swept;
+			}
 
-			Pool() : _free(nullptr)
+			Chunk* _add_chunk()
 			{
-				/* allocate chars since I don't want T's constructor called on the elements */
-				_itr = _begin = (T*) new char[sizeof(T) * POOL_SIZE];
-				_end = _itr + POOL_SIZE;
+				_chunks.emplace_back(new Chunk());
+				auto chunk = _chunks.back().get();
+				_by_end[chunk->_end] = chunk;
+				_make_available(chunk);
+				return chunk;
+			}
 
-				for(unsigned int i = 0; i < FIELDS; ++i) _bits[i] = 0;
+			void _make_available(Chunk* chunk)
+			{
+				if(!chunk->_available)
+					{
+						chunk->_available = true;
+						_available.push_back(chunk);
+					}
 			}
 
-			~Pool()
+			/// @return: the Chunk holding `pointer`, or nullptr
+			Chunk* chunk_of(T *pointer)
 			{
-				// Use the 'mark' bit to indicate which cells are
-				// free, and shouldn't be destructed
+				auto found = _by_end.upper_bound(pointer);
+				if(found == _by_end.end() || pointer < found->second->_begin)
+					{ return nullptr; }
+				return found->second;
+			}
 
-				// Destruct anything that's not free
-				for(size_t i = 0; i < POOL_SIZE; ++i)
-					{ if(is_allocated(i)) { _begin[i].~T(); } }
+			bool is_marked(size_t offset)
+			{ return _chunks[0]->is_marked(offset); }
+
+			bool is_allocated(size_t offset)
+			{ return _chunks[0]->is_allocated(offset); }
 
-				delete[] (char*)_begin;
+			bool is_marked(T* pointer)
+			{
+				auto chunk = chunk_of(pointer);
+				return chunk->is_marked(pointer - chunk->_begin);
 			}
 
-			T *begin() { return _begin; }
-			T *end() { return _end; }
+			bool is_allocated(T* pointer)
+			{
+				auto chunk = chunk_of(pointer);
+				return chunk->is_allocated(pointer - chunk->_begin);
+			}
 
 			// @param p: pointer to the object that needs marking
 			void mark(T *p)
-			{ set_mark(p - _begin); }
+			{
+				auto chunk = chunk_of(p);
+				assert(chunk);
+				chunk->set_mark(p - chunk->_begin);
+			}
+
+			/// Mark `p`, @return: false if it was already marked
+			bool try_mark(T *p)
+			{
+				auto chunk = chunk_of(p);
+				assert(chunk);
+				return chunk->try_mark(p - chunk->_begin);
+			}
 
-			// allocates a T from the array, checking _free list
-			// first.
+			/** Allocates a T from a Chunk with room, adding a Chunk if
+			 * we're under the _chunk_limit.
+			 *
+			 * @return: the (unconstructed) T or nullptr if the pool
+			 * should be collected or grown first.
+			 */
 			T* alloc()
 			{
-				T *tmp;
-				if(_free != nullptr)
+				while(!_available.empty())
 					{
-						tmp = _free;
-						_free = *reinterpret_cast<T**>(_free);
+						auto chunk = _available.back();
+						_count_swept(chunk->finish_sweep());
+						if(auto tmp = chunk->alloc())
+							{ return tmp; }
+
+						chunk->_available = false;
+						_available.pop_back();
 					}
 
-				else if(_itr != _end)
-					tmp = _itr++;
+				if(_chunks.size() < _chunk_limit)
+					{ return _add_chunk()->alloc(); }
 
-				else
-					return nullptr;
+				return nullptr;
+			}
 
-				set_allocated(tmp);
-				return tmp;
+			/// Add a Chunk even though we're at the _chunk_limit.
+			T* grow()
+			{
+				++_chunk_limit;
+				return _add_chunk()->alloc();
 			}
 
 			void free(T* pointer)
 			{
-				auto offset = pointer - _begin;
-				pointer->~T();	  // call the destructor
-				unset_allocated(offset);
-				unset_mark(offset);
-
-				if((pointer + 1) == _itr)
-					{ --_itr; }
-				else {
-					*reinterpret_cast<T**>(pointer) = _free;
-					_free = pointer;
-				}
+				auto chunk = chunk_of(pointer);
+				_count_swept(chunk->finish_sweep());
+				chunk->free(pointer);
+				_make_available(chunk);
 			}
 
-			// delete all un-marked objects (and re-set mark flags)
+			/** Delete all un-marked objects (and re-set mark flags).
+			 * Chunks left empty are released, and the _chunk_limit
+			 * reset to twice what the survivors need.
+			 *
+			 * With SweepMode::lazy or concurrent the Chunks are only
+			 * flagged for sweeping, and this returns 0.
+			 */
 			virtual unsigned int sweep()
 			{
+				if(sweep_mode != SweepMode::eager)
+					{
+						_available.clear();
+						for(auto& chunk : _chunks)
+							{
+								chunk->flag_unswept();
+								chunk->_available = false;
+								_make_available(chunk.get());
+							}
+						_chunk_limit = _chunks.size() << 1;
+						_sweep_cursor = 0;
+
+						if(sweep_mode == SweepMode::concurrent)
+							{
+								_unswept_chunks.clear();
+								for(auto& chunk : _chunks)
+									{ _unswept_chunks.push_back(chunk.get()); }
+							}
+						return 0;
+					}
+
 				unsigned int swept = 0;
+				for(auto& chunk : _chunks)
+					{ swept += chunk->sweep(); }
 
-				for(unsigned int i = 0; i < POOL_SIZE; ++i)
-				{
-					if(is_allocated(i))
-						{
-							if(is_marked(i))
-								{ unset_mark(i); }
-							else
-								{
-									free(_begin + i);
-									++swept;
-								}
-						}
-				}
+				_reclaim();
+				return _count_swept(swept);
+			}
 
-				return swept;
+			/// Release empty Chunks and rebuild the _available list.
+			void _reclaim()
+			{
+				_available.clear();
+				for(auto& chunk : _chunks)
+					{ chunk->_available = false; }
+
+				auto keep = _chunks.begin() + 1;
+				for(auto itr = keep; itr != _chunks.end(); ++itr)
+					{
+						if((*itr)->empty())
+							{ _by_end.erase((*itr)->_end); }
+						else
+							{ std::swap(*keep++, *itr); }
+					}
+				_chunks.erase(keep, _chunks.end());
+
+				for(auto& chunk : _chunks)
+					{
+						if(!chunk->full())
+							{ _make_available(chunk.get()); }
+					}
+
+				_chunk_limit = _chunks.size() << 1;
+			}
+
+			/** Sweep the next Chunk a lazy sweep left behind (Chunks
+			 * alloc has already swept are skipped).
+			 *
+			 * @return: false if there was nothing left to sweep
+			 */
+			bool sweep_slice()
+			{
+				for(; _sweep_cursor < _chunks.size(); ++_sweep_cursor)
+					{
+						auto& chunk = _chunks[_sweep_cursor];
+						if(chunk->unswept())
+							{
+								_count_swept(chunk->finish_sweep());
+								++_sweep_cursor;
+								return true;
+							}
+					}
+				return false;
+			}
+
+			/** Sweep any Chunks a lazy sweep left behind.  Has to
+			 * happen before the next mark phase, or last cycle's marks
+			 * would keep this cycle's garbage.
+			 *
+			 * @return: number of items freed
+			 */
+			unsigned int finish_sweep()
+			{
+				unsigned int swept = 0;
+				for(auto& chunk : _chunks)
+					{ swept += chunk->finish_sweep(); }
+				_unswept_chunks.clear();
+
+				_reclaim();
+				return _count_swept(swept);
+			}
+
+			/** Sweep the Chunks flagged by a concurrent sweep, from the
+			 * sweeper thread.  Only touches Chunks it claims, so alloc
+			 * can carry on meanwhile; finish_sweep has to wait for it
+			 * to return.
+			 *
+			 * @return: number of items freed
+			 */
+			unsigned int sweep_concurrently()
+			{
+				unsigned int swept = 0;
+				for(auto chunk : _unswept_chunks)
+					{ swept += chunk->finish_sweep(); }
+				return _count_swept(swept);
 			}
 
 			void print() {
-				for(unsigned int i=0; i < FIELDS; ++i) {
-					std::cout << "[";
-					print_binary( _bits[i] );
-					std::cout << "]" << std::endl;
-				}
+				for(auto& chunk : _chunks)
+					{
+						for(unsigned int i=0; i < FIELDS; ++i) {
+							std::cout << "[";
+							print_binary( chunk->_alloc[i] );
+							std::cout << "|";
+							print_binary( chunk->_mark[i] );
+							std::cout << "]" << std::endl;
+						}
+					}
 			}
 
-			// test whether ptr is in this particular array
-			int cmp(T *ptr) {
-				if(ptr < _begin)  return -1;
-				if(ptr >= _end)	 return 1;
-				return 0;
+			// test whether ptr is in one of our Chunks
+			bool contains(T *ptr) { return chunk_of(ptr) != nullptr; }
+
+			size_t num_chunks() const { return _chunks.size(); }
+
+			size_t size() const
+			{
+				size_t counter = 0;
+				for(auto& chunk : _chunks)
+					{ counter += chunk->_itr - chunk->_begin; }
+				return counter;
 			}
 
-			size_t size() const { return _itr - _begin; }
 			size_t num_free() const
 			{
 				size_t counter = 0;
-				auto itr = _free;
-				while(itr)
+				for(auto& chunk : _chunks)
+					{ counter += chunk->num_free(); }
+				return counter;
+			}
+
+			size_t num_allocated() const
+			{
+				size_t counter = 0;
+				for(auto& chunk : _chunks)
+					{ counter += chunk->_allocated; }
+				return counter;
+			}
+
+			size_t num_marked() const
+			{
+				size_t counter = 0;
+				for(auto& chunk : _chunks)
 					{
-						++counter;
-						itr = *reinterpret_cast<T**>(itr);
+						for(size_t i = 0; i < FIELDS; ++i)
+							{ counter += popcount(chunk->_mark[i]); }
 					}
 				return counter;
 			}
 
-			size_t num_allocated() const
-			{ return size() - num_free(); }
+			/// Items freed by sweeping since the Pool was made
+			size_t num_swept() const
+			{ return __atomic_load_n(&_swept, __ATOMIC_RELAXED); }
 		};
 	}
 }
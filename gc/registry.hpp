@@ -0,0 +1,109 @@
+#ifndef ATL_GC_REGISTRY_HPP
+#define ATL_GC_REGISTRY_HPP
+/**
+ * @file /home/ryan/programming/atl/gc/registry.hpp
+ * @author Ryan Domigan <ryan_domigan@sutdents@uml.edu>
+ * Created on Oct 19, 2026
+ *
+ * Lists of the things a collector asks to mark its roots, which
+ * don't allocate to add or remove one.
+ */
+
+#include <cstddef>
+#include <vector>
+
+namespace atl
+{
+	/** Doubly linked list threaded through its items, which need
+	 * `T *_prev, *_next` members.
+	 */
+	template<class T>
+	struct IntrusiveList
+	{
+		T* head;
+		size_t _size;
+
+		IntrusiveList() : head(nullptr), _size(0) {}
+
+		IntrusiveList(IntrusiveList const&) = delete;
+
+		void push_front(T* item)
+		{
+			item->_prev = nullptr;
+			item->_next = head;
+			if(head) { head->_prev = item; }
+			head = item;
+			++_size;
+		}
+
+		void erase(T* item)
+		{
+			(item->_prev ? item->_prev->_next : head) = item->_next;
+			if(item->_next) { item->_next->_prev = item->_prev; }
+			--_size;
+		}
+
+		/// Put `item` in the list where `old` is.
+		void replace(T* old, T* item)
+		{
+			item->_prev = old->_prev;
+			item->_next = old->_next;
+			(item->_prev ? item->_prev->_next : head) = item;
+			if(item->_next) { item->_next->_prev = item; }
+		}
+
+		size_t size() const { return _size; }
+
+		template<class Fn>
+		void for_each(Fn&& fn)
+		{
+			for(auto item = head; item; item = item->_next)
+				{ fn(*item); }
+		}
+	};
+
+	/** Callbacks at stable indexes.  A removed callback's index is
+	 * reused by the next one added, so once the table has grown,
+	 * adding one doesn't allocate (beyond whatever the callback type
+	 * itself does).
+	 */
+	template<class Fn>
+	struct CallbackTable
+	{
+		std::vector<Fn> _callbacks;
+		std::vector<size_t> _free;
+
+		size_t add(Fn const& fn)
+		{
+			if(_free.empty())
+				{
+					_callbacks.push_back(fn);
+					return _callbacks.size() - 1;
+				}
+
+			auto index = _free.back();
+			_free.pop_back();
+			_callbacks[index] = fn;
+			return index;
+		}
+
+		void remove(size_t index)
+		{
+			_callbacks[index] = nullptr;
+			_free.push_back(index);
+		}
+
+		size_t size() const { return _callbacks.size() - _free.size(); }
+
+		template<class ... Args>
+		void operator()(Args&& ... args)
+		{
+			for(auto& fn : _callbacks)
+				{
+					if(fn) { fn(args...); }
+				}
+		}
+	};
+}
+
+#endif
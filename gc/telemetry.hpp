@@ -0,0 +1,97 @@
+#ifndef ATL_GC_TELEMETRY_HPP
+#define ATL_GC_TELEMETRY_HPP
+/**
+ * @file /home/ryan/programming/atl/gc/telemetry.hpp
+ * @author Ryan Domigan <ryan_domigan@sutdents@uml.edu>
+ * Created on Oct 19, 2026
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+#include <atl/type.hpp>
+
+namespace atl
+{
+	/// What one collection did
+	struct CollectionTelemetry
+	{
+		typedef std::chrono::microseconds Duration;
+
+		Duration mark, sweep, pause;
+
+		// Pool objects allocated going into the collection and how
+		// many of them were marked.
+		size_t pool_allocated, pool_marked;
+
+		// Ast cells the AstPool evacuated from and the cells it
+		// copied.
+		size_t ast_collected_cells, ast_copied_cells;
+
+		// Was it a major AstPool collection, and did the AstPool
+		// decide to grow its young generation after it?
+		bool ast_major, ast_resize;
+
+		CollectionTelemetry()
+			: mark(0), sweep(0), pause(0),
+			  pool_allocated(0), pool_marked(0),
+			  ast_collected_cells(0), ast_copied_cells(0),
+			  ast_major(false), ast_resize(false)
+		{}
+
+		size_t ast_copied_bytes() const
+		{ return ast_copied_cells * sizeof(Any); }
+
+		/// Fraction of the pool objects which survived
+		double pool_survival() const
+		{ return pool_allocated ? double(pool_marked) / pool_allocated : 0; }
+
+		/// Fraction of the collected Ast cells which survived
+		double ast_survival() const
+		{ return ast_collected_cells ? double(ast_copied_cells) / ast_collected_cells : 0; }
+	};
+
+	/// Occupancy of one of the GC's memory_pool::Pools
+	struct PoolTelemetry
+	{
+		const char* name;
+		size_t allocated, free, swept;
+	};
+
+	/** Counters the GC keeps as it collects.  Recording them is a few
+	 * clock reads and bitmap popcounts per collection; the per-pool
+	 * numbers are only worked out when GC::telemetry is called.
+	 */
+	struct GCTelemetry
+	{
+		size_t collections, major_collections, ast_resizes;
+
+		// Totals over every collection
+		CollectionTelemetry::Duration mark, sweep;
+		size_t ast_copied_cells;
+
+		CollectionTelemetry last;
+
+		// Filled in by GC::telemetry
+		std::vector<PoolTelemetry> pools;
+
+		GCTelemetry()
+			: collections(0), major_collections(0), ast_resizes(0),
+			  mark(0), sweep(0), ast_copied_cells(0)
+		{}
+
+		void record(CollectionTelemetry const& collection)
+		{
+			last = collection;
+			++collections;
+			if(collection.ast_major) { ++major_collections; }
+			if(collection.ast_resize) { ++ast_resizes; }
+			mark += collection.mark;
+			sweep += collection.sweep;
+			ast_copied_cells += collection.ast_copied_cells;
+		}
+	};
+}
+
+#endif
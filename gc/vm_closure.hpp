@@ -1,26 +1,272 @@
 #ifndef ATL_GC_VM_CLOSURE_HPP
 #define ATL_GC_VM_CLOSURE_HPP
 
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <atl/gc/registry.hpp>
+
 namespace atl
 {
-	// Type allocated by the VM to describe a function's closure.
+	namespace closure_pool_detail
+	{
+		/** Cells of `words` pcode values each; a closure with N
+		 * captures takes a cell of N + 2 words.
+		 */
+		struct Slab
+		{
+			typedef pcode::value_type value_type;
+
+			// Slabs are about this many words, or one cell if the
+			// cells are bigger.
+			static const size_t SLAB_WORDS = 4096;
+
+			size_t words, cells;
+			value_type *_begin, *_end;
+
+			std::vector<bool> allocated, marked;
+			std::vector<size_t> free;
+
+			// Is this Slab on its size class's available list
+			bool available;
+
+			Slab(size_t words_)
+				: words(words_),
+				  cells(std::max<size_t>(1, SLAB_WORDS / words_)),
+				  allocated(cells, false),
+				  marked(cells, false),
+				  available(false)
+			{
+				_begin = new value_type[words * cells];
+				_end = _begin + (words * cells);
+
+				free.reserve(cells);
+				for(size_t cell = cells; cell; --cell)
+					{ free.push_back(cell - 1); }
+			}
+
+			~Slab() { delete[] _begin; }
+
+			bool full() const { return free.empty(); }
+			size_t num_allocated() const { return cells - free.size(); }
+
+			value_type* alloc()
+			{
+				if(free.empty()) { return nullptr; }
+
+				auto cell = free.back();
+				free.pop_back();
+				allocated[cell] = true;
+				return _begin + (cell * words);
+			}
+
+			/** The closure `pointer` refers to, either by its start or
+			 * by the captured values (which is how a frame holds its
+			 * closure).
+			 *
+			 * @return: the closure's cell, or cells if `pointer`
+			 * isn't a live closure in this Slab.
+			 */
+			size_t cell_of(value_type* pointer) const
+			{
+				auto offset = static_cast<size_t>(pointer - _begin);
+				auto cell = offset / words, part = offset % words;
+
+				if((part == 0 || part == 2) && allocated[cell])
+					{ return cell; }
+				return cells;
+			}
+
+			/// @return: number of closures freed
+			size_t sweep()
+			{
+				size_t swept = 0;
+				for(size_t cell = 0; cell < cells; ++cell)
+					{
+						if(allocated[cell] && !marked[cell])
+							{
+								allocated[cell] = false;
+								free.push_back(cell);
+								++swept;
+							}
+						marked[cell] = false;
+					}
+				return swept;
+			}
+		};
+	}
+
+	/** Allocates the closures made by the VM.  Closures are tagless
+	 * words on the VM's stack, so they're marked conservatively: any
+	 * word in a root range (or a marked closure) which points at a
+	 * live closure keeps it alive.
+	 *
+	 * Closures are allocated from Slabs, one list of Slabs per closure
+	 * size.  Once the words allocated since the last collection pass
+	 * `limit`, the next allocation collects first.
+	 */
 	struct ClosurePool
 	{
-		std::vector<pcode::value_type*> closures;
+		typedef pcode::value_type value_type;
+		typedef closure_pool_detail::Slab Slab;
+
+		// Mark the closures a root range refers to (with mark_range)
+		typedef std::function<void (ClosurePool&)> MarkCallback;
+		typedef CallbackTable<MarkCallback> RootsType;
+
+		static const size_t INITIAL_LIMIT = 1 << 14;
+
+		RootsType _roots;
+
+		std::vector<std::unique_ptr<Slab> > _slabs;
+
+		// Slabs keyed by their _end, for finding which one a word
+		// points into.
+		std::map<value_type*, Slab*> _by_end;
 
-		~ClosurePool()
-		{ for(auto cc : closures) { delete[] cc; } }
+		// Slabs with free cells, indexed by cell size
+		std::vector<std::vector<Slab*> > _available;
 
-		pcode::value_type* closure(pcode::value_type body_location,
-		                           size_t formals,
-		                           size_t captures)
+		size_t limit, _allocated_words;
+
+		// Marked closures whose captured values haven't been scanned
+		std::vector<std::pair<Slab*, size_t> > _gray;
+
+		ClosurePool() : limit(INITIAL_LIMIT), _allocated_words(0) {}
+
+		/// @return: the index to remove the root by
+		size_t add_root(MarkCallback const& fn)
+		{ return _roots.add(fn); }
+
+		void remove_root(size_t index) { _roots.remove(index); }
+
+		value_type* closure(value_type body_location,
+		                    size_t formals,
+		                    size_t captures)
 		{
-			auto rval = new pcode::value_type[captures + 2];
+			auto words = captures + 2;
+
+			if(_allocated_words + words > limit)
+				{ collect(); }
+
+			auto rval = _alloc(words);
+			_allocated_words += words;
+
 			rval[0] = formals;
 			rval[1] = body_location;
-			closures.push_back(rval);
 			return rval;
 		}
+
+		value_type* _alloc(size_t words)
+		{
+			if(_available.size() <= words)
+				{ _available.resize(words + 1); }
+
+			auto& available = _available[words];
+			while(!available.empty())
+				{
+					if(auto rval = available.back()->alloc())
+						{ return rval; }
+
+					available.back()->available = false;
+					available.pop_back();
+				}
+
+			_slabs.emplace_back(new Slab(words));
+			auto slab = _slabs.back().get();
+			_by_end[slab->_end] = slab;
+
+			slab->available = true;
+			available.push_back(slab);
+
+			return slab->alloc();
+		}
+
+		/// Mark the closures referred to by words in [begin, end)
+		void mark_range(value_type const* begin, value_type const* end)
+		{
+			for(; begin < end; ++begin)
+				{ _mark_word(*begin); }
+
+			while(!_gray.empty())
+				{
+					auto gray = _gray.back();
+					_gray.pop_back();
+
+					auto cell = gray.first->_begin + (gray.second * gray.first->words);
+					for(auto itr = cell + 2; itr != cell + gray.first->words; ++itr)
+						{ _mark_word(*itr); }
+				}
+		}
+
+		void _mark_word(value_type word)
+		{
+			auto pointer = reinterpret_cast<value_type*>(word);
+
+			auto found = _by_end.upper_bound(pointer);
+			if(found == _by_end.end() || pointer < found->second->_begin)
+				{ return; }
+
+			auto slab = found->second;
+			auto cell = slab->cell_of(pointer);
+			if(cell != slab->cells && !slab->marked[cell])
+				{
+					slab->marked[cell] = true;
+					_gray.emplace_back(slab, cell);
+				}
+		}
+
+		/** Free the closures no root refers to and release empty
+		 * Slabs.
+		 *
+		 * @return: number of closures freed
+		 */
+		size_t collect()
+		{
+			_roots(*this);
+
+			size_t swept = 0, live_words = 0;
+			for(auto& slab : _slabs)
+				{
+					swept += slab->sweep();
+					live_words += slab->num_allocated() * slab->words;
+				}
+
+			for(auto& available : _available)
+				{ available.clear(); }
+
+			auto keep = _slabs.begin();
+			for(auto itr = _slabs.begin(); itr != _slabs.end(); ++itr)
+				{
+					if(!(*itr)->num_allocated())
+						{ _by_end.erase((*itr)->_end); }
+					else
+						{
+							auto slab = itr->get();
+							slab->available = !slab->full();
+							if(slab->available)
+								{ _available[slab->words].push_back(slab); }
+
+							std::swap(*keep++, *itr);
+						}
+				}
+			_slabs.erase(keep, _slabs.end());
+
+			_allocated_words = live_words;
+			limit = std::max(size_t(INITIAL_LIMIT), live_words * 2);
+			return swept;
+		}
+
+		size_t num_closures() const
+		{
+			size_t counter = 0;
+			for(auto& slab : _slabs)
+				{ counter += slab->num_allocated(); }
+			return counter;
+		}
 	};
 }
 
@@ -0,0 +1,78 @@
+#ifndef ATL_HELPERS_BOUNDED_QUEUE_HPP
+#define ATL_HELPERS_BOUNDED_QUEUE_HPP
+/**
+ * @file /home/ryan/programming/atl/helpers/bounded_queue.hpp
+ * @author Ryan Domigan <ryan_domigan@sutdents@uml.edu>
+ * Created on Oct 19, 2026
+ */
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+namespace atl
+{
+	/** FIFO for handing work between two threads.  push blocks
+	 * while the queue is full and pop blocks while it's empty,
+	 * until the queue is closed.
+	 */
+	template<class T>
+	struct BoundedQueue
+	{
+		std::deque<T> _items;
+		size_t _capacity;
+		bool _closed;
+
+		std::mutex _mutex;
+		std::condition_variable _not_full, _not_empty;
+
+		explicit BoundedQueue(size_t capacity)
+			: _capacity(capacity ? capacity : 1)
+			, _closed(false)
+		{}
+
+		/** @return: false if the queue was closed, in which case
+		 * `item` was dropped.
+		 */
+		bool push(T item)
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_not_full.wait(lock, [this]() { return _closed || _items.size() < _capacity; });
+
+			if(_closed)
+				{ return false; }
+
+			_items.push_back(std::move(item));
+			_not_empty.notify_one();
+			return true;
+		}
+
+		/** @return: false once the queue is closed and drained */
+		bool pop(T& item)
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_not_empty.wait(lock, [this]() { return _closed || !_items.empty(); });
+
+			if(_items.empty())
+				{ return false; }
+
+			item = std::move(_items.front());
+			_items.pop_front();
+			_not_full.notify_one();
+			return true;
+		}
+
+		/// No more pushes; pop drains what's left.
+		void close()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_closed = true;
+			_not_full.notify_all();
+			_not_empty.notify_all();
+		}
+	};
+}
+
+#endif
@@ -394,6 +394,7 @@ namespace atl
 
 		Marked<Ast> operator()(Ast& ast)
 		{
+			GC::HandleScope scope(gc);
 			auto builder = gc.ast_builder();
 			auto walker = walk_values(toplevel, ast.subex());
 
@@ -211,5 +211,76 @@ namespace atl
 	};
 	const std::string Parser::_ws = " \n\t";
 	const std::string Parser::delim = "()\" \n\t";
+
+	/** Copy the text of the next top level form in `stream` to
+	 * `form` without parsing it, so the reading can be done away
+	 * from the GC.  Comments are dropped and newlines outside of
+	 * strings become spaces, leaving the form on one line.
+	 *
+	 * @return: false if the stream ends before another form starts
+	 */
+	inline bool read_form(std::istream& stream, std::string& form)
+	{
+		form.clear();
+		long depth = 0;
+		char cc;
+
+		while(stream.get(cc))
+			{
+				switch(cc)
+					{
+					case ';':
+						while(stream.get(cc) && cc != '\n');
+						// fall through
+					case '\n':
+					case ' ':
+					case '\t':
+						if(!form.empty() && form.back() != ' ' && form.back() != '\'')
+							{ form.push_back(' '); }
+						continue;
+
+					case '\'':
+						form.push_back(cc);
+						continue;
+
+					case '(':
+						++depth;
+						form.push_back(cc);
+						continue;
+
+					case ')':
+						if(!depth)
+							{ throw UnbalancedParens("unexpected ')'"); }
+						form.push_back(cc);
+						if(!--depth)
+							{ return true; }
+						continue;
+
+					case '"':
+						form.push_back(cc);
+						while(stream.get(cc) && cc != '"')
+							{ form.push_back(cc); }
+						if(!stream)
+							{ throw UnbalancedParens("string not terminated."); }
+						form.push_back(cc);
+						if(!depth)
+							{ return true; }
+						continue;
+
+					default:
+						form.push_back(cc);
+						while(stream.peek() != std::char_traits<char>::eof()
+						      && std::string("()\" \n\t;").find(static_cast<char>(stream.peek())) == std::string::npos)
+							{ form.push_back(static_cast<char>(stream.get())); }
+						if(!depth)
+							{ return true; }
+						continue;
+					}
+			}
+
+		if(depth)
+			{ throw UnbalancedParens("unbalanced parens"); }
+		return false;
+	}
 }
 #endif
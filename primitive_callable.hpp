@@ -11,6 +11,7 @@
 
 #include "./type.hpp"
 #include "./ffi_helper.hpp"
+#include "./byte_code.hpp"
 
 namespace atl
 {
@@ -40,13 +41,53 @@ namespace atl
 		/**  / ___ \| |  | | |_| | | | | | | | | (_| | |_| | (__  **/
 		/** /_/   \_\_|  |_|\__|_| |_|_| |_| |_|\__,_|\__|_|\___| **/
 		/***********************************************************/
-		definer.function<Pack<long (long, long)> >("add2", [](long a, long b) { return a + b;});
-		definer.function<Pack<long (long, long)> >("sub2", [](long a, long b) { return a - b;});
-		definer.function<Pack<bool (long, long)> >("=", [](long a, long b) { return a = b;});
-		definer.function<Pack<bool (long, long)> >("<", [](long a, long b) { return a < b;});
-		definer.function<Pack<bool (long, long)> >(">", [](long a, long b) { return a > b;});
-		definer.function<Pack<bool (long, long)> >("<=", [](long a, long b) { return a <= b;});
-		definer.function<Pack<bool (long, long)> >(">=", [](long a, long b) { return a >= b;});
+		using namespace vm_codes;
+		definer.function<Pack<long (long, long)> >("add2", [](long a, long b) { return a + b;}, Purity::pure, Tag<fixnum_add>::value);
+		definer.function<Pack<long (long, long)> >("sub2", [](long a, long b) { return a - b;}, Purity::pure, Tag<fixnum_sub>::value);
+		definer.function<Pack<bool (long, long)> >("=", [](long a, long b) { return a == b;}, Purity::pure, Tag<fixnum_eq>::value);
+		definer.function<Pack<bool (long, long)> >("<", [](long a, long b) { return a < b;}, Purity::pure, Tag<fixnum_lt>::value);
+		definer.function<Pack<bool (long, long)> >(">", [](long a, long b) { return a > b;}, Purity::pure, Tag<fixnum_gt>::value);
+		definer.function<Pack<bool (long, long)> >("<=", [](long a, long b) { return a <= b;}, Purity::pure, Tag<fixnum_le>::value);
+		definer.function<Pack<bool (long, long)> >(">=", [](long a, long b) { return a >= b;}, Purity::pure, Tag<fixnum_ge>::value);
+
+		// Telemetry from GC::telemetry; times are in microseconds and
+		// survival in percent.
+		auto gc_pntr = &atl.gc;
+		auto stat = [gc_pntr, &definer](std::string const& name, std::function<long (GCTelemetry const&)> const& fn)
+			{
+				definer.function<Pack<long ()> >
+				(name, [gc_pntr, fn]() { return fn(gc_pntr->telemetry()); });
+			};
+
+		stat("gc-collections", [](GCTelemetry const& gc) { return gc.collections; });
+		stat("gc-major-collections", [](GCTelemetry const& gc) { return gc.major_collections; });
+		stat("gc-ast-resizes", [](GCTelemetry const& gc) { return gc.ast_resizes; });
+		stat("gc-last-pause", [](GCTelemetry const& gc) { return gc.last.pause.count(); });
+		stat("gc-last-mark", [](GCTelemetry const& gc) { return gc.last.mark.count(); });
+		stat("gc-last-sweep", [](GCTelemetry const& gc) { return gc.last.sweep.count(); });
+		stat("gc-last-ast-copied-bytes", [](GCTelemetry const& gc) { return gc.last.ast_copied_bytes(); });
+		stat("gc-last-survival", [](GCTelemetry const& gc) { return long(gc.last.pool_survival() * 100); });
+		stat("gc-last-ast-survival", [](GCTelemetry const& gc) { return long(gc.last.ast_survival() * 100); });
+
+		// Per pool, by the name of the type it holds (like "String")
+		auto pool_stat = [gc_pntr, &definer](std::string const& name, std::function<long (PoolTelemetry const&)> const& fn)
+			{
+				definer.function<Pack<long (std::string*)> >
+				(name,
+				 [gc_pntr, fn, name](std::string* pool) -> long
+				 {
+					 for(auto& item : gc_pntr->telemetry().pools)
+						 {
+							 if(*pool == item.name)
+								 { return fn(item); }
+						 }
+					 throw RangeError(name + ": no pool for " + *pool);
+				 });
+			};
+
+		pool_stat("gc-pool-allocated", [](PoolTelemetry const& pool) { return pool.allocated; });
+		pool_stat("gc-pool-free", [](PoolTelemetry const& pool) { return pool.free; });
+		pool_stat("gc-pool-swept", [](PoolTelemetry const& pool) { return pool.swept; });
 	}
 }
 
@@ -46,6 +46,21 @@ TEST_F(AnalyzeAndCompile, test_type_inference)
 	ASSERT_EQ(tt<Fixnum>(), type);
 }
 
+TEST_F(AnalyzeAndCompile, test_inferring_parameter_types)
+{
+	using namespace make_ast;
+	auto expr = intrp.gc(mk(wrap<Lambda>(),
+	                        mk("a", "b"),
+	                        mk("equal2", "a", mk("add2", "b", 1))));
+
+	intrp.annotate(*expr);
+
+	using make_type::tt;
+	auto formals = expr->begin() + 1;
+	for(auto formal : atl::subex(formals))
+		{ ASSERT_EQ(tt<Fixnum>(), unwrap<Symbol>(formal).scheme.type); }
+}
+
 TEST_F(AnalyzeAndCompile, test_if_false)
 {
 	using namespace make_ast;
@@ -219,3 +234,97 @@ TEST_F(AnalyzeAndCompile, test_simple_recursion_results)
 	ASSERT_EQ(wrap<Fixnum>(8),
 	          intrp.eval_ast(mk("main")));
 }
+
+TEST_F(AnalyzeAndCompile, test_inlining_known_function)
+{
+	using namespace make_ast;
+	auto call_closure = vm_codes::Tag<vm_codes::call_closure>::value;
+
+	intrp.eval_ast(mk
+	        ("define", "foo", mk(wrap<Lambda>(),
+	                             mk("a"),
+	                             mk("add2", "a", 3))));
+
+	auto bar_begin = intrp.compiler.code_store.size();
+	intrp.eval_ast(mk("define", "bar",
+	                  mk(wrap<Lambda>(),
+	                     mk("b"),
+	                     mk("foo", "b"))));
+
+	ASSERT_EQ(0, count_instruction(intrp.compiler.code_store,
+	                               call_closure,
+	                               bar_begin));
+	ASSERT_EQ(wrap<Fixnum>(5), intrp.eval_ast(mk("bar", 2)));
+
+	intrp.noinline("foo");
+
+	auto baz_begin = intrp.compiler.code_store.size();
+	intrp.eval_ast(mk("define", "baz",
+	                  mk(wrap<Lambda>(),
+	                     mk("b"),
+	                     mk("foo", "b"))));
+
+	ASSERT_EQ(1, count_instruction(intrp.compiler.code_store,
+	                               vm_codes::Tag<vm_codes::tail_call>::value,
+	                               baz_begin));
+	ASSERT_EQ(wrap<Fixnum>(5), intrp.eval_ast(mk("baz", 2)));
+}
+
+TEST_F(AnalyzeAndCompile, test_tail_recursion_runs_in_constant_stack)
+{
+	using namespace make_ast;
+
+	auto recur_begin = intrp.compiler.code_store.size();
+	intrp.eval_ast
+		(mk
+		 ("define", "simple-recur",
+		  mk(wrap<Lambda>(),
+		     mk("a", "b"),
+		     mk("if",
+		        mk("equal2", 0, "a"),
+		        "b",
+		        mk("simple-recur",
+		           mk("sub2", "a", 1),
+		           mk("add2", "b", 1))))));
+
+	// The self call is a jump, not a new frame
+	ASSERT_EQ(0, count_instruction(intrp.compiler.code_store,
+	                               vm_codes::Tag<vm_codes::call_closure>::value,
+	                               recur_begin));
+	ASSERT_EQ(0, count_instruction(intrp.compiler.code_store,
+	                               vm_codes::Tag<vm_codes::tail_call>::value,
+	                               recur_begin));
+
+	intrp.eval_ast
+		(mk(wrap<Define>(), "main",
+		    mk(wrap<Lambda>(),
+		       mk("n"),
+		       mk("simple-recur", "n", 0))));
+
+	ASSERT_EQ(wrap<Fixnum>(5000), intrp.eval_ast(mk("main", 5000)));
+}
+
+TEST_F(AnalyzeAndCompile, test_applied_lambda_binds_locals)
+{
+	using namespace make_ast;
+	auto& code = intrp.compiler.code_store;
+
+	auto begin = code.size();
+	intrp.eval_ast
+		(mk
+		 ("define", "foo",
+		  mk(wrap<Lambda>(),
+		     mk("a"),
+		     mk(mk(wrap<Lambda>(),
+		           mk("b"),
+		           mk("sub2", "a", "b")),
+		        3))));
+
+	// `b` is a local of foo's frame, and `a` is read straight from
+	// foo's arguments; only foo its self needs a closure, and only
+	// foo returns.
+	ASSERT_EQ(1, count_instruction(code, vm_codes::Tag<vm_codes::make_closure>::value, begin));
+	ASSERT_EQ(1, count_instruction(code, vm_codes::Tag<vm_codes::return_>::value, begin));
+	ASSERT_EQ(0, count_instruction(code, vm_codes::Tag<vm_codes::call_procedure>::value, begin));
+	ASSERT_EQ(wrap<Fixnum>(7), intrp.eval_ast(mk("foo", 10)));
+}
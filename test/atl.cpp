@@ -11,6 +11,8 @@
 #include <atl/atl.hpp>
 #include <atl/primitive_callable.hpp>
 
+#include "./testing_utils.hpp"
+
 #include <gtest/gtest.h>
 #include <fstream>
 #include <sstream>
@@ -110,3 +112,507 @@ TEST_F(AtlTest, test_file_contents)
 	atl.eval(content);
 	atl.eval("(foo 2)");
 }
+
+TEST_F(AtlTest, test_load_definitions_in_parallel)
+{
+	using namespace atl;
+	std::stringstream source;
+	for(int i = 0; i < 32; ++i)
+		{ source << "(define f" << i << " (__\\__ (a) (add2 a " << i << ")))\n"; }
+	source << "(define main (__\\__ (n) (f31 n)))\n"
+	       << "(main (f30 1))\n";
+
+	// The same forms, one at a time through eval
+	Atl evaluated;
+	export_primitives(evaluated);
+
+	Any evaluated_result;
+	{
+		std::istringstream lines(source.str());
+		std::string line;
+		while(std::getline(lines, line))
+			{ evaluated_result = evaluated.eval(line); }
+	}
+
+	std::stringstream parallel_source(source.str());
+
+	ASSERT_EQ(wrap<Fixnum>(62), evaluated_result);
+	ASSERT_EQ(wrap<Fixnum>(62), atl.load(parallel_source, 4));
+
+	// All 33 definitions went through compile_segments
+	ASSERT_EQ(0, evaluated.compiler.linked_segments);
+	ASSERT_EQ(33, atl.compiler.linked_segments);
+
+	auto& evaluated_code = evaluated.compiler.code_store;
+	auto& parallel_code = atl.compiler.code_store;
+
+	ASSERT_EQ(evaluated_code, parallel_code);
+	ASSERT_EQ(evaluated_code.relocations, parallel_code.relocations);
+	ASSERT_EQ(evaluated_code.num_slots, parallel_code.num_slots);
+	ASSERT_EQ(evaluated_code.offset_table["main"],
+	          parallel_code.offset_table["main"]);
+	ASSERT_EQ(evaluated_code.offset_table["f0"],
+	          parallel_code.offset_table["f0"]);
+
+	// and the lambdas know where their bodies ended up
+	auto body_address = [](Atl& atl, std::string const& name)
+		{
+			Any lambda;
+			atl.compiler._known_lambda(unwrap<GlobalSlot>(atl.lexical.local[name]).value, lambda);
+			return unwrap<Lambda>(*subex(lambda).begin()).value->body_address;
+		};
+	ASSERT_EQ(body_address(evaluated, "main"), body_address(atl, "main"));
+	ASSERT_EQ(body_address(evaluated, "f7"), body_address(atl, "f7"));
+}
+
+TEST_F(AtlTest, test_load_merges_specializations)
+{
+	using namespace atl;
+	auto return_ = vm_codes::Tag<vm_codes::return_>::value;
+	auto& code = atl.compiler.code_store;
+	atl.compiler.inline_limit = 0;
+
+	// Both callers get a Bool, Fixnum, Fixnum copy of choose, each
+	// in its own segment
+	std::stringstream source;
+	source << "(define choose (__\\__ (p a b) (if p a b)))\n"
+	       << "(define low (__\\__ (n) (choose (< n 0) 7 n)))\n"
+	       << "(define high (__\\__ (n) (choose (> n 9) 9 n)))\n"
+	       << "(low -3)\n";
+
+	ASSERT_EQ(wrap<Fixnum>(7), atl.load(source, 3));
+	ASSERT_EQ(3, atl.compiler.linked_segments);
+
+	// A later definition re-uses a linked copy
+	auto begin = code.size();
+	atl.eval("(define mid (__\\__ (n) (add2 (choose #t n 0) 1)))");
+	ASSERT_EQ(1, count_instruction(code, return_, begin));
+
+	ASSERT_EQ(wrap<Fixnum>(6), atl.eval("(mid 5)"));
+	ASSERT_EQ(wrap<Fixnum>(9), atl.eval("(high 12)"));
+	ASSERT_EQ(wrap<Fixnum>(4), atl.eval("(high 4)"));
+}
+
+TEST_F(AtlTest, test_fixnum_primitives_compile_to_instructions)
+{
+	using namespace atl;
+
+	auto begin = atl.compiler.code_store.size();
+	atl.eval("(define foo (__\\__ (a b) (< (sub2 (add2 a b) 1) b)))");
+
+	auto& code = atl.compiler.code_store;
+	ASSERT_EQ(0, count_instruction(code, vm_codes::Tag<vm_codes::std_function>::value, begin));
+	ASSERT_EQ(1, count_instruction(code, vm_codes::Tag<vm_codes::fixnum_add>::value, begin));
+	ASSERT_EQ(1, count_instruction(code, vm_codes::Tag<vm_codes::fixnum_lt>::value, begin));
+
+	ASSERT_EQ(wrap<Bool>(false), atl.eval("(foo 2 3)"));
+	ASSERT_EQ(wrap<Bool>(true), atl.eval("(foo -5 3)"));
+}
+
+TEST_F(AtlTest, test_specializing_polymorphic_function)
+{
+	using namespace atl;
+	auto call_procedure = vm_codes::Tag<vm_codes::call_procedure>::value,
+		return_ = vm_codes::Tag<vm_codes::return_>::value;
+	auto& code = atl.compiler.code_store;
+
+	atl.eval("(define choose (__\\__ (p a b) (if p a b)))");
+	atl.noinline("choose");
+
+	// main's body and choose's Bool, Fixnum, Fixnum copy
+	auto main_begin = code.size();
+	atl.eval("(define main (__\\__ (n) (add2 (choose (< n 0) 7 n) 1)))");
+	ASSERT_EQ(1, count_instruction(code, call_procedure, main_begin));
+	ASSERT_EQ(2, count_instruction(code, return_, main_begin));
+
+	// re-uses the copy
+	auto other_begin = code.size();
+	atl.eval("(define other (__\\__ (n) (choose #f 2 n)))");
+	ASSERT_EQ(1, count_instruction(code, vm_codes::Tag<vm_codes::tail_procedure>::value, other_begin));
+	ASSERT_EQ(1, count_instruction(code, return_, other_begin));
+
+	ASSERT_EQ(wrap<Fixnum>(8), atl.eval("(main -3)"));
+	ASSERT_EQ(wrap<Fixnum>(4), atl.eval("(main 3)"));
+	ASSERT_EQ(wrap<Fixnum>(5), atl.eval("(other 5)"));
+}
+
+TEST_F(AtlTest, test_load_multi_line_forms)
+{
+	using namespace atl;
+	std::stringstream source;
+	source << "; setup\n"
+	       << "(define inc (__\\__ (a)\n"
+	       << "  (add2 a 1))) ; trailing\n"
+	       << "(inc 1)\n";
+	for(int i = 0; i < 8; ++i)
+		{ source << "(define g" << i << "\n  (__\\__ (a) (inc (add2 a " << i << "))))\n"; }
+	source << "(g7\n (g1 0))\n";
+
+	// with one form of read ahead the reader and front end alternate
+	ASSERT_EQ(wrap<Fixnum>(10), atl.load(source, 2, 1));
+}
+
+TEST_F(AtlTest, test_load_stops_at_read_error)
+{
+	using namespace atl;
+	std::stringstream source;
+	source << "(define inc (__\\__ (a) (add2 a 1)))\n"
+	       << ") (inc 1)\n";
+
+	ASSERT_THROW(atl.load(source, 2, 1), UnbalancedParens);
+}
+
+TEST_F(AtlTest, test_tree_shake)
+{
+	using namespace atl;
+
+	atl.eval("(define used (__\\__ (a) (add2 a 1)))");
+	atl.eval("(define unused (__\\__ (a) (sub2 a 1)))");
+	atl.eval("(define main (__\\__ () (used 2)))");
+
+	auto before = atl.compiler.code_store.size();
+	ASSERT_EQ(1, atl.tree_shake("main"));
+
+	ASSERT_LT(atl.compiler.code_store.size(), before);
+	ASSERT_EQ(0, atl.lexical.local.count("unused"));
+	ASSERT_EQ(0, atl.gamma.symbols.count("unused"));
+	ASSERT_EQ(wrap<Fixnum>(3), atl.eval("(main)"));
+}
+
+TEST_F(AtlTest, test_tree_shake_keeps_side_effects)
+{
+	using namespace atl;
+	std::stringstream output;
+	atl.stdout = &output;
+	atl.compiler.lazy = true;
+
+	atl.eval("(define used (__\\__ (a) (add2 a 1)))");
+	atl.eval("(define unused (__\\__ (a) (sub2 a 1)))");
+	atl.eval("(define logged (__\\__ (a) (add2 a 2)))");
+	atl.eval("(define noisy (print-int (logged 5)))");
+	atl.eval("(define main (__\\__ () (used 2)))");
+	atl.noinline("used");
+
+	ASSERT_EQ(wrap<Fixnum>(3), atl.eval("(main)"));
+	ASSERT_EQ(1, atl.tree_shake("main"));
+
+	// noisy prints, so it stays along with what it calls
+	ASSERT_EQ(1, atl.lexical.local.count("noisy"));
+	ASSERT_EQ(1, atl.lexical.local.count("logged"));
+	ASSERT_EQ(0, atl.lexical.local.count("unused"));
+
+	// Redefining what main calls recompiles it against the new code
+	atl.eval("(define used (__\\__ (a) (add2 a 10)))");
+	ASSERT_EQ(wrap<Fixnum>(12), atl.eval("(main)"));
+	ASSERT_EQ(wrap<Fixnum>(8), atl.eval("(logged 6)"));
+}
+
+TEST_F(AtlTest, test_sharing_common_subexpressions)
+{
+	using namespace atl;
+	auto call_closure = vm_codes::Tag<vm_codes::call_closure>::value;
+	auto& code = atl.compiler.code_store;
+
+	atl.eval("(define double (__\\__ (a) (add2 a a)))");
+	atl.noinline("double");
+
+	auto shared_begin = code.size();
+	atl.eval("(define shared (__\\__ (n) (add2 (double (sub2 n 1)) (double (sub2 n 1)))))");
+	auto shared_size = code.size() - shared_begin;
+	ASSERT_EQ(1, count_instruction(code, call_closure, shared_begin));
+
+	// same shape, but nothing to share
+	auto distinct_begin = code.size();
+	atl.eval("(define distinct (__\\__ (n) (add2 (double (sub2 n 1)) (double (sub2 n 2)))))");
+	auto distinct_size = code.size() - distinct_begin;
+	ASSERT_EQ(2, count_instruction(code, call_closure, distinct_begin));
+
+	ASSERT_LT(shared_size, distinct_size);
+	ASSERT_EQ(wrap<Fixnum>(12), atl.eval("(shared 4)"));
+	ASSERT_EQ(wrap<Fixnum>(6), atl.eval("(distinct 3)"));
+}
+
+TEST_F(AtlTest, test_folding_branch_on_defined_constant)
+{
+	using namespace atl;
+	auto if_ = vm_codes::Tag<vm_codes::if_>::value;
+
+	atl.eval("(define debug #f)");
+	atl.eval("(define limit (add2 2 3))");
+
+	auto begin = atl.compiler.code_store.size();
+	atl.eval("(define foo (__\\__ (a) (if debug (print-int a) (if (< a limit) a limit))))");
+
+	// only the test on `a` is left
+	ASSERT_EQ(1, count_instruction(atl.compiler.code_store, if_, begin));
+	ASSERT_EQ(wrap<Fixnum>(3), atl.eval("(foo 3)"));
+	ASSERT_EQ(wrap<Fixnum>(5), atl.eval("(foo 7)"));
+}
+
+TEST_F(AtlTest, test_folding_comparisons)
+{
+	using namespace atl;
+	auto if_ = vm_codes::Tag<vm_codes::if_>::value;
+
+	auto begin = atl.compiler.code_store.size();
+	atl.eval("(define pick (__\\__ (a) (if (= 2 3) (add2 a 1) (if (= 3 3) a 0))))");
+
+	// `=` compares, so both tests fold away
+	ASSERT_EQ(0, count_instruction(atl.compiler.code_store, if_, begin));
+	ASSERT_EQ(wrap<Fixnum>(4), atl.eval("(pick 4)"));
+}
+
+TEST_F(AtlTest, test_caching_repeated_expressions)
+{
+	using namespace atl;
+	atl.eval("(define double (__\\__ (a) (add2 a a)))");
+
+	auto code_size = atl.compiler.code_store.size();
+
+	ASSERT_EQ(wrap<Fixnum>(10), atl.eval("(double 5)"));
+	ASSERT_EQ(wrap<Fixnum>(10), atl.eval("(double  5)"));
+	ASSERT_EQ(wrap<Fixnum>(12), atl.eval("(double 6)"));
+
+	ASSERT_EQ(1, atl.expression_cache.hits);
+	ASSERT_EQ(2, atl.expression_cache.misses);
+	ASSERT_EQ(code_size, atl.compiler.code_store.size());
+}
+
+TEST_F(AtlTest, test_lazy_lambda_bodies)
+{
+	using namespace atl;
+	auto lazy_compile = vm_codes::Tag<vm_codes::lazy_compile>::value;
+	auto& code = atl.compiler.code_store;
+	atl.compiler.lazy = true;
+
+	atl.eval("(define used (__\\__ (a) (add2 a 1)))");
+	atl.eval("(define unused (__\\__ (a) (sub2 a 1)))");
+	atl.eval("(define twice (__\\__ (a) (used (used a))))");
+	atl.noinline("used");
+	atl.noinline("twice");
+	ASSERT_EQ(3, count_instruction(code, lazy_compile, 0));
+
+	ASSERT_EQ(wrap<Fixnum>(5), atl.eval("(twice 3)"));
+
+	// the bodies which ran were kept when the expression was dropped
+	auto compiled_size = code.size();
+	ASSERT_EQ(1, count_instruction(code, lazy_compile, 0));
+
+	ASSERT_EQ(wrap<Fixnum>(12), atl.eval("(twice 10)"));
+	ASSERT_EQ(compiled_size, code.size());
+}
+
+TEST_F(AtlTest, test_redefinition_recompiles_dependents)
+{
+	using namespace atl;
+	atl.eval("(define inc (__\\__ (a) (add2 a 1)))");
+	atl.eval("(define twice (__\\__ (a) (inc (inc a))))");
+	atl.eval("(define late (__\\__ (a) (inc a)))");
+	atl.noinline("late");
+	ASSERT_EQ(wrap<Fixnum>(5), atl.eval("(twice 3)"));
+
+	atl.eval("(define inc (__\\__ (a) (add2 a 10)))");
+
+	// `twice` inlined the old `inc`
+	ASSERT_TRUE(atl.compiler.depends_on(unwrap<GlobalSlot>(atl.lexical.local["twice"]).value,
+	                                    {unwrap<GlobalSlot>(atl.lexical.local["inc"]).value}));
+	ASSERT_EQ(wrap<Fixnum>(23), atl.eval("(twice 3)"));
+	ASSERT_EQ(wrap<Fixnum>(13), atl.eval("(late 3)"));
+
+	// the type has to stay the same
+	ASSERT_THROW(atl.eval("(define inc (__\\__ (a b) (add2 a b)))"), RedefinitionError);
+	ASSERT_EQ(wrap<Fixnum>(13), atl.eval("(inc 3)"));
+}
+
+TEST_F(AtlTest, test_nested_let_locals)
+{
+	using namespace atl;
+	auto& code = atl.compiler.code_store;
+
+	auto begin = code.size();
+	atl.eval("(define foo (__\\__ (a b)"
+	         "  ((__\\__ (c) ((__\\__ (d e) (add2 (sub2 d e) (add2 a c))) (add2 c b) c))"
+	         "   (add2 a 1))))");
+
+	ASSERT_EQ(1, count_instruction(code, vm_codes::Tag<vm_codes::make_closure>::value, begin));
+	ASSERT_EQ(0, count_instruction(code, vm_codes::Tag<vm_codes::call_closure>::value, begin));
+
+	// c = 11, d = 13, e = 11: (13 - 11) + (10 + 11)
+	ASSERT_EQ(wrap<Fixnum>(23), atl.eval("(foo 10 2)"));
+
+	// a tail call from a let body still replaces the frame
+	atl.eval("(define loop (__\\__ (n acc)"
+	         "  (if (= n 0) acc ((__\\__ (m) (loop m (add2 acc 2))) (sub2 n 1)))))");
+	ASSERT_EQ(wrap<Fixnum>(2000), atl.eval("(loop 1000 0)"));
+}
+
+TEST_F(AtlTest, test_lifting_let_bound_lambda)
+{
+	using namespace atl;
+	auto& code = atl.compiler.code_store;
+
+	// `f` is only ever called, so it gets lifted: `k` is passed to
+	// it rather than captured and only foo needs a closure
+	auto begin = code.size();
+	atl.eval("(define foo (__\\__ (k)"
+	         "  ((__\\__ (f) (add2 (f k) (f 3))) (__\\__ (y) (add2 y k)))))");
+
+	ASSERT_EQ(1, count_instruction(code, vm_codes::Tag<vm_codes::make_closure>::value, begin));
+	ASSERT_EQ(2, count_instruction(code, vm_codes::Tag<vm_codes::call_procedure>::value, begin));
+	ASSERT_EQ(wrap<Fixnum>(33), atl.eval("(foo 10)"));
+
+	// lifted bodies can bind locals and make tail calls of their own
+	atl.eval("(define loop (__\\__ (n acc)"
+	         "  ((__\\__ (step) (if (= n 0) acc (step (sub2 n 1))))"
+	         "   (__\\__ (m) ((__\\__ (a) (loop m a)) (add2 acc 2))))))");
+	ASSERT_EQ(wrap<Fixnum>(20000), atl.eval("(loop 10000 0)"));
+}
+
+TEST_F(AtlTest, test_closures_are_collected)
+{
+	using namespace atl;
+
+	atl.eval("(define make-adder (__\\__ (n) (__\\__ (x) (add2 x n))))");
+	atl.eval("(define spin (__\\__ (n acc)"
+	         "  (if (= n 0) acc (spin (sub2 n 1) ((make-adder 1) acc)))))");
+
+	ASSERT_EQ(wrap<Fixnum>(100000), atl.eval("(spin 100000 0)"));
+	ASSERT_GT(size_t(ClosurePool::INITIAL_LIMIT), atl.gc._closure_pool.num_closures());
+}
+
+TEST_F(AtlTest, test_parallel_mark)
+{
+	using namespace atl;
+
+	atl.gc.mark_threads = 4;
+
+	std::vector<Marked<Ast> > kept;
+	for(long i = 0; i < 2000; ++i)
+		{
+			kept.push_back
+				(atl.gc([&](AstBuilder& builder)
+				        {
+					        NestAst nest(builder);
+					        builder.push_back(wrap<Fixnum>(i));
+					        builder.push_back(atl.gc.amake<String>(std::to_string(i)));
+				        }));
+			if(i % 100 == 0) { atl.gc.gc(); }
+		}
+
+	atl.eval("(define add-one (__\\__ (x) (add2 x 1)))");
+	atl.gc.gc();
+
+	for(long i = 0; i < 2000; ++i)
+		{
+			Ast ast = *kept[i];
+			ASSERT_EQ(wrap<Fixnum>(i), ast[0]);
+			ASSERT_EQ(std::to_string(i), unwrap<String>(ast[1]).value);
+		}
+	ASSERT_EQ(wrap<Fixnum>(3), atl.eval("(add-one 2)"));
+}
+
+TEST_F(AtlTest, test_gc_telemetry)
+{
+	using namespace atl;
+
+	for(size_t i = 0; i < 1000; ++i)
+		{ atl.gc.raw_make<String>("garbage"); }
+	atl.eval("(define add-one (__\\__ (x) (add2 x 1)))");
+	atl.gc.gc();
+
+	auto& telemetry = atl.gc.telemetry();
+	ASSERT_LT(0, telemetry.collections);
+	ASSERT_LT(0, telemetry.last.pool_allocated);
+	ASSERT_GT(telemetry.last.pool_allocated, telemetry.last.pool_marked);
+	ASSERT_LT(0, telemetry.last.ast_copied_cells);
+
+	auto found = std::find_if(telemetry.pools.begin(), telemetry.pools.end(),
+	                          [](PoolTelemetry const& pool) { return pool.name == std::string("String"); });
+	ASSERT_NE(telemetry.pools.end(), found);
+	ASSERT_LE(1000, found->swept);
+	auto swept = found->swept;
+
+	ASSERT_EQ(wrap<Fixnum>(telemetry.collections), atl.eval("(gc-collections)"));
+	ASSERT_EQ(wrap<Fixnum>(swept), atl.eval("(gc-pool-swept \"String\")"));
+}
+
+TEST_F(AtlTest, test_collecting_while_running)
+{
+	using namespace atl;
+	using namespace signature;
+
+	auto gc = &atl.gc;
+	PrimitiveDefiner definer(atl.gc, atl.lexical);
+	definer.function<Pack<long ()> >
+		("make-garbage", [gc]() -> long
+		 {
+			 gc->raw_make<String>("garbage");
+			 return 1;
+		 });
+
+	// String cells, used or free
+	auto strings = [&]()
+		{
+			for(auto& pool : atl.gc.telemetry().pools)
+				{
+					if(pool.name == std::string("String"))
+						{ return pool.allocated + pool.free; }
+				}
+			return size_t(0);
+		};
+
+	atl.eval("(define spin (__\\__ (n) (if (= n 0) 0 (spin (sub2 n (make-garbage))))))");
+
+	// Every String is garbage as soon as it's made, so the pool
+	// shouldn't grow with the length of the loop
+	auto collections = atl.gc.telemetry().collections;
+	ASSERT_EQ(wrap<Fixnum>(0), atl.eval("(spin 20000)"));
+	ASSERT_LT(collections, atl.gc.telemetry().collections);
+	auto after_short = strings();
+
+	ASSERT_EQ(wrap<Fixnum>(0), atl.eval("(spin 200000)"));
+	ASSERT_GT(20000, after_short);
+	ASSERT_EQ(after_short, strings());
+}
+
+TEST_F(AtlTest, test_definitions_in_bounded_memory)
+{
+	using namespace atl;
+	size_t definitions = 400;
+
+	for(size_t i = 0; i < definitions; ++i)
+		{
+			auto num = std::to_string(i);
+			atl.eval("(define g" + num + " (__\\__ (x) (add2 x " + num + ")))");
+		}
+
+	// Collections put off while annotating run once it's done, so
+	// the young Backers which overflowed meanwhile get collected and
+	// the AstPool stays in proportion to what's defined.
+	ASSERT_GE(1, atl.gc._ast_pool._young_overflow.size());
+	ASSERT_GT(200 * definitions, atl.gc._ast_pool.size());
+	ASSERT_EQ(wrap<Fixnum>(400), atl.eval("(g399 1)"));
+}
+
+TEST_F(AtlTest, test_handle_scope)
+{
+	using namespace atl;
+
+	auto before = atl.gc._handles.size();
+	{
+		GC::HandleScope scope(atl.gc);
+
+		auto kept = atl.gc.marked(wrap<Fixnum>(1));
+		for(long i = 0; i < 100; ++i)
+			{
+				auto short_lived = atl.gc.make<String>("garbage");
+				kept = atl.gc.marked(wrap<Fixnum>(i));
+			}
+		ASSERT_EQ(wrap<Fixnum>(99), *kept);
+	}
+	ASSERT_EQ(before, atl.gc._handles.size());
+
+	atl.eval("(define add-one (__\\__ (x) (add2 x 1)))");
+	ASSERT_EQ(wrap<Fixnum>(3), atl.eval("(add-one 2)"));
+	ASSERT_EQ(before, atl.gc._handles.size());
+}
@@ -104,17 +104,56 @@ TEST_F(CompilerTest, test_nested_application)
 	          compile.code_store);
 }
 
+TEST_F(CompilerTest, test_constant_folding)
+{
+	using namespace make_ast;
+	fns.wadd->pure = true;
+	fns.wsub->pure = true;
+
+	compile.compile(store(mk(add, mk(sub, 7, 5), mk(add, 8, 3))));
+
+	Code code;
+	AssembleCode assemble(&code);
+
+	assemble.constant(13);
+
+	ASSERT_EQ(code,
+	          compile.code_store);
+}
+
+TEST_F(CompilerTest, test_folding_arguments_of_impure_call)
+{
+	using namespace make_ast;
+	fns.wsub->pure = true;
+
+	compile.compile(store(mk(add, mk(sub, 7, 5), 3)));
+
+	Code code;
+	AssembleCode assemble(&code);
+
+	assemble
+		.constant(2)
+		.constant(3)
+		.std_function(fn_add, 2);
+
+	ASSERT_EQ(code,
+	          compile.code_store);
+	ASSERT_EQ(5, run());
+}
+
 TEST_F(CompilerTest, test_if)
 {
 	using namespace make_ast;
-	compile.compile(store(mk(wrap<If>(), wrap<Bool>(true), 3, 4)));
+	compile.compile(store(mk(wrap<If>(), mk(equal, 1, 2), 3, 4)));
 
 	Code code;
 	AssembleCode assemble(&code);
 
 	assemble.add_label("alternate")
 		.constant(0xdeadbeef)
-		.constant(true)
+		.constant(1)
+		.constant(2)
+		.std_function(fn_equal, 2)
 		.if_()
 		.constant(3)
 		.add_label("to-end")
@@ -128,6 +167,23 @@ TEST_F(CompilerTest, test_if)
 	          compile.code_store);
 }
 
+TEST_F(CompilerTest, test_if_constant_predicate)
+{
+	using namespace make_ast;
+	compile.compile(store(mk(wrap<If>(), wrap<Bool>(false), 3, mk(add, 2, 2))));
+
+	Code code;
+	AssembleCode assemble(&code);
+
+	assemble.constant(2)
+		.constant(2)
+		.std_function(fn_add, 2);
+
+	ASSERT_EQ(code,
+	          compile.code_store);
+	ASSERT_EQ(4, run());
+}
+
 
 TEST_F(CompilerTest, test_basic_lambda)
 {
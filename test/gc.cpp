@@ -3,3 +3,4 @@
 #include "test_gc/ast_pool.cpp"
 #include "test_gc/gc.cpp"
 #include "test_gc/pool.cpp"
+#include "test_gc/pauses.cpp"
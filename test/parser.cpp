@@ -161,3 +161,24 @@ TEST_F(ParserTest, test_comments)
 			    << printer::print(*parsed) << std::endl;
 	    }
 }
+
+TEST_F(ParserTest, test_read_form)
+{
+	std::istringstream input("; leading comment\n"
+	                         "(foo \"a ; b\"\n"
+	                         "     'bar) ; trailing\n"
+	                         "baz\n"
+	                         "\n");
+	string form;
+
+	ASSERT_TRUE(read_form(input, form));
+	ASSERT_EQ("(foo \"a ; b\" 'bar)", form);
+
+	ASSERT_TRUE(read_form(input, form));
+	ASSERT_EQ("baz", form);
+
+	ASSERT_FALSE(read_form(input, form));
+
+	std::istringstream unbalanced("(foo (bar)");
+	ASSERT_THROW(read_form(unbalanced, form), UnbalancedParens);
+}
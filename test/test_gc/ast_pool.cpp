@@ -188,3 +188,43 @@ TEST_F(TestAstPool, test_moving_ast_twice)
 
 	asts.gc_finish();
 }
+
+TEST_F(TestAstPool, test_old_generation)
+{
+	using namespace atl;
+	Ast ast_a, old_a;
+
+	auto build = *asts.ast_backer();
+	build.nest_ast();
+	build.emplace_back(wrap<Fixnum>(1));
+	build.emplace_back(wrap<Fixnum>(2));
+	build.end_ast();
+
+	ast_a = build.ast();
+
+	// Surviving a collection promotes the Ast...
+	asts.gc_start();
+	old_a = asts.move(ast_a);
+	asts.gc_finish();
+
+	ASSERT_EQ(3, asts.old_size());
+
+	// ...after which minor collections leave it in place
+	asts.gc_start();
+	ASSERT_EQ(old_a.value, asts.move(old_a).value);
+	ASSERT_EQ(old_a.value, asts.move(old_a).value);
+	asts.gc_finish();
+
+	ASSERT_EQ(3, asts.old_size());
+
+	// and a major collection copies it to a new old generation.
+	asts._old_limit = 0;
+	asts.gc_start();
+	auto major_a = asts.move(old_a);
+	ASSERT_NE(old_a.value, major_a.value);
+	asts.gc_finish();
+
+	ASSERT_EQ(3, asts.old_size());
+	ASSERT_EQ(Any(tag<Fixnum>::value, reinterpret_cast<void*>(1)), major_a[0]);
+	ASSERT_EQ(Any(tag<Fixnum>::value, reinterpret_cast<void*>(2)), major_a[1]);
+}
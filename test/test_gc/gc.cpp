@@ -12,17 +12,18 @@ TEST(TestGC, test_marked_move_in_order)
 	// testing the _move method
 	using namespace atl;
 
-	Marked<Any> *top = nullptr;
-	Marked<Any> aa(top, wrap<Null>()),
-		bb(top, wrap<Null>());
+	HandleArena arena;
+	Marked<Any> aa(arena, wrap<Null>()),
+		bb(arena, wrap<Null>());
 
-	// so should be top->bb->aa->0
-	ASSERT_EQ(top, &bb);
-	ASSERT_EQ(bb._up, &aa);
+	ASSERT_EQ(2, arena.size());
+	ASSERT_EQ(&bb, arena.slots[1]);
 
+	// cc takes over bb's slot
 	Marked<Any> cc(std::move(bb));
-	ASSERT_EQ(top, &cc);
-	ASSERT_EQ(cc._up, &aa);
+	ASSERT_EQ(2, arena.size());
+	ASSERT_EQ(&cc, arena.slots[1]);
+	ASSERT_EQ(&aa, arena.slots[0]);
 }
 
 TEST(TestGC, test_marked_move_out_of_order)
@@ -30,30 +31,24 @@ TEST(TestGC, test_marked_move_out_of_order)
 	// testing the _move method
 	using namespace atl;
 
-	Marked<Any> *top = nullptr;
-	Marked<Any> aa(top, wrap<Null>()),
-		bb(top, wrap<Null>());
-
-	// so should be top->bb->aa->0
-	ASSERT_EQ(top, &bb);
-	ASSERT_EQ(bb._up, &aa);
+	HandleArena arena;
+	Marked<Any> aa(arena, wrap<Null>()),
+		bb(arena, wrap<Null>());
 
 	Marked<Any> cc(std::move(aa));
-	// now should be top->cc->bb->0
-	ASSERT_EQ(top, &cc);
-	ASSERT_EQ(cc._up, &bb);
-	ASSERT_EQ(bb._up, nullptr);
-}
-
-size_t marked_count(atl::Marked<atl::Any>* itr)
-{
-	size_t count = 0;
-	while(itr)
-		{
-			itr = itr->_up;
-			++count;
-		}
-	return count;
+	ASSERT_EQ(&cc, arena.slots[0]);
+	ASSERT_EQ(&bb, arena.slots[1]);
+
+	// Releasing the bottom slot leaves a hole until a HandleScope
+	// compacts it.
+	cc = Marked<Any>();
+	ASSERT_EQ(2, arena.size());
+	ASSERT_EQ(nullptr, arena.slots[0]);
+
+	arena.compact(0);
+	ASSERT_EQ(1, arena.size());
+	ASSERT_EQ(&bb, arena.slots[0]);
+	ASSERT_EQ(0, bb._slot);
 }
 
 TEST(TestGC, test_marked_equal)
@@ -61,28 +56,31 @@ TEST(TestGC, test_marked_equal)
 	// testing the _move method
 	using namespace atl;
 
-	Marked<Any> *top = nullptr;
+	HandleArena arena;
 
-	Marked<Any> aa(top, wrap<Null>()),
-		bb(top, wrap<Null>());
+	Marked<Any> aa(arena, wrap<Null>()),
+		bb(arena, wrap<Null>());
 
-	ASSERT_EQ(2, marked_count(top));
+	ASSERT_EQ(2, arena.size());
 
-	Marked<Any> cc(top, wrap<Null>());
+	Marked<Any> cc(arena, wrap<Null>());
 
-	ASSERT_EQ(3, marked_count(top));
+	ASSERT_EQ(3, arena.size());
 
+	// cc's own slot (the top) is released and it takes aa's.
 	cc = std::move(aa);
 
-	ASSERT_EQ(2, marked_count(top));
-	ASSERT_EQ(&bb, cc._up);
-	ASSERT_EQ(&cc, top);
+	ASSERT_EQ(2, arena.size());
+	ASSERT_EQ(&cc, arena.slots[0]);
+	ASSERT_EQ(&bb, arena.slots[1]);
 
-	bb = Marked<Any>(top, wrap<Null>());
+	// The new handle is pushed before bb lets its old slot go, so
+	// that slot becomes a hole.
+	bb = Marked<Any>(arena, wrap<Null>());
 
-	ASSERT_EQ(2, marked_count(top));
-	ASSERT_EQ(&cc, bb._up);
-	ASSERT_EQ(&bb, top);
+	ASSERT_EQ(3, arena.size());
+	ASSERT_EQ(nullptr, arena.slots[1]);
+	ASSERT_EQ(&bb, arena.slots[2]);
 }
 
 TEST(TestGC, test_mark_atoms)
@@ -119,7 +117,7 @@ TEST(TestGC, test_mark_LambdaMetadata)
 				formals.push_back(Any(tag<Symbol>::value, gc.raw_make<Symbol>("a")));
 				formals.push_back(Any(tag<Symbol>::value, gc.raw_make<Symbol>("b")));
 			}
-			return formals.root();
+			return unwrap<Ast>(formals.built());
 		};
 
 	{
@@ -236,9 +234,9 @@ TEST(TestGC, test_nested_ast)
 			NestAst nest_outer(outer);
 
 			outer.push_back(wrap<Fixnum>(1));
-			outer.push_back(wrap(inner.root()));
+			outer.push_back(wrap(unwrap<Ast>(inner.built())));
 
-			ast = gc.marked(outer.root());
+			ast = gc.marked(unwrap<Ast>(outer.built()));
 		}
 	}
 	std::cout << printer::with_type(*ast) << std::endl;
@@ -319,7 +317,7 @@ TEST(TestGC, test_moving_wrapped_ast)
 		builder.push_back(wrap<Fixnum>(1));
 		builder.push_back(wrap<Fixnum>(2));
 
-		as_ast = builder.root();
+		as_ast = unwrap<Ast>(builder.built());
 	}
 
 	Marked<Any> ast = gc.marked(as_ast);
@@ -0,0 +1,97 @@
+#include <chrono>
+
+#include <atl/gc/gc.hpp>
+#include <atl/gc/pause_histogram.hpp>
+
+#include <gtest/gtest.h>
+
+TEST(TestPauses, test_percentile)
+{
+	using namespace atl;
+	using std::chrono::microseconds;
+
+	PauseHistogram pauses;
+
+	ASSERT_EQ(0, PauseHistogram::bucket_of(microseconds(0)));
+	ASSERT_EQ(1, PauseHistogram::bucket_of(microseconds(1)));
+	ASSERT_EQ(3, PauseHistogram::bucket_of(microseconds(7)));
+	ASSERT_EQ(4, PauseHistogram::bucket_of(microseconds(8)));
+
+	for(size_t i = 0; i < 99; ++i)
+		{ pauses.record(microseconds(5)); }
+	pauses.record(microseconds(900));
+
+	ASSERT_EQ(100, pauses.count);
+	ASSERT_EQ(microseconds(7), pauses.percentile(0.99));
+	ASSERT_EQ(microseconds(900), pauses.percentile(1.0));
+	ASSERT_EQ(microseconds(900), pauses.longest);
+}
+
+/* With lazy sweeping, what a collection leaves is swept in slices as
+ * things are allocated.  Collections and slices are recorded apart. */
+TEST(TestPauses, test_sweep_slices)
+{
+	using namespace atl;
+
+	GC gc;
+	gc.sweep_mode(memory_pool::SweepMode::lazy);
+
+	for(size_t i = 0; i < 2000; ++i)
+		{ gc.raw_make<String>("garbage"); }
+
+	auto collections = gc.collection_pauses.count;
+	auto slices = gc.sweep_pauses.count;
+	gc.gc();
+	ASSERT_EQ(collections + 1, gc.collection_pauses.count);
+	ASSERT_EQ(slices, gc.sweep_pauses.count);
+	ASSERT_TRUE(gc._sweeping);
+	ASSERT_LT(0, gc._string_heap.num_allocated());
+
+	gc.pause_budget = PauseHistogram::Duration(0);
+	while(gc._sweeping)
+		{ gc.raw_make<Symbol>("s"); }
+
+	ASSERT_LT(slices, gc.sweep_pauses.count);
+	ASSERT_EQ(0, gc._string_heap.num_allocated());
+}
+
+/* An eager collection sweeps everything itself, leaving no slices. */
+TEST(TestPauses, test_eager_sweep)
+{
+	using namespace atl;
+
+	GC gc;
+	gc.sweep_mode(memory_pool::SweepMode::eager);
+
+	for(size_t i = 0; i < 2000; ++i)
+		{ gc.raw_make<String>("garbage"); }
+
+	gc.gc();
+	ASSERT_FALSE(gc._sweeping);
+	ASSERT_EQ(0, gc._string_heap.num_allocated());
+}
+
+/* A concurrent sweep frees the garbage on the sweeper thread, while
+ * allocation carries on. */
+TEST(TestPauses, test_concurrent_sweep)
+{
+	using namespace atl;
+
+	GC gc;
+	gc.sweep_mode(memory_pool::SweepMode::concurrent);
+
+	for(size_t round = 0; round < 5; ++round)
+		{
+			for(size_t i = 0; i < 2000; ++i)
+				{ gc.raw_make<String>("garbage"); }
+
+			gc.gc();
+			ASSERT_FALSE(gc._sweeping);
+
+			for(size_t i = 0; i < 500; ++i)
+				{ gc.raw_make<String>("more garbage"); }
+		}
+
+	gc._join_sweeper();
+	ASSERT_GE(500, gc._string_heap.num_allocated());
+}
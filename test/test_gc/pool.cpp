@@ -37,21 +37,21 @@ TEST(TestPool, test_bit_manipulations)
 	Pool pool{};
 
 	auto bit_fields = Pool::FIELDS;
-	ASSERT_EQ(128, bit_fields);
+	ASSERT_EQ(64, bit_fields);
 
-	ASSERT_EQ(1, Pool::_alloc_bit(0));
-	ASSERT_EQ(2, Pool::_mark_bit(0));
-
-	// 01000000
-	ASSERT_EQ(64, Pool::_alloc_bit(3));
+	ASSERT_EQ(1, Pool::_bit(0));
+	// 00001000
+	ASSERT_EQ(8, Pool::_bit(3));
 	// 10000000
-	ASSERT_EQ(128, Pool::_mark_bit(3));
+	ASSERT_EQ(128, Pool::_bit(7));
+	ASSERT_EQ(1, Pool::_bit(8));
 
 	ASSERT_EQ(0, Pool::_field(0));
 	ASSERT_EQ(0, Pool::_field(3));
-	ASSERT_EQ(1, Pool::_field(4));
-	ASSERT_EQ(1, Pool::_field(7));
-	ASSERT_EQ(2, Pool::_field(8));
+	ASSERT_EQ(0, Pool::_field(7));
+	ASSERT_EQ(1, Pool::_field(8));
+	ASSERT_EQ(1, Pool::_field(15));
+	ASSERT_EQ(2, Pool::_field(16));
 
 	pool.mark(pool._begin + 2);
 	ASSERT_TRUE(pool.is_marked(2));
@@ -102,3 +102,74 @@ TEST(TestPool, test_mark)
 	ASSERT_EQ(Set({"a", "b", "c"}), destoyed);
 }
 
+
+/* Allocating past one chunk adds chunks, and sweeping releases the
+ * ones left empty. */
+TEST(TestPool, test_chunks)
+{
+	using namespace atl;
+	typedef memory_pool::Pool<uintptr_t, unsigned char, 8> Pool;
+
+	Pool pool;
+	std::vector<uintptr_t*> items;
+
+	for(size_t i = 0; i < Pool::POOL_SIZE; ++i)
+		{ ASSERT_NE(nullptr, pool.alloc()); }
+	ASSERT_EQ(nullptr, pool.alloc());
+	pool.sweep();
+	ASSERT_EQ(0, pool.num_allocated());
+
+	for(size_t i = 0; i < 100; ++i)
+		{
+			auto item = pool.alloc();
+			if(!item) { item = pool.grow(); }
+			items.push_back(item);
+		}
+
+	ASSERT_EQ(100, pool.num_allocated());
+	ASSERT_EQ(13, pool.num_chunks());
+
+	for(auto item : items)
+		{ ASSERT_TRUE(pool.contains(item)); }
+
+	pool.mark(items[3]);
+	pool.mark(items[99]);
+	ASSERT_TRUE(pool.is_marked(items[99]));
+	pool.sweep();
+
+	ASSERT_EQ(2, pool.num_allocated());
+	ASSERT_EQ(2, pool.num_chunks());
+	ASSERT_FALSE(pool.is_marked(items[99]));
+}
+
+/* A lazy sweep frees things when their chunk is next allocated from
+ * (or by finish_sweep), not when the pool is swept. */
+TEST(TestPool, test_lazy_sweep)
+{
+	using namespace atl;
+	typedef test::CallbackOnDestruct CBD;
+
+	typedef std::set<std::string> Set;
+	Set destoyed;
+
+	auto update_destroyed = [&destoyed](std::string const& name)
+		{ destoyed.insert(name); };
+
+	memory_pool::Pool<CBD, unsigned char, 8> pool(memory_pool::SweepMode::lazy);
+
+	new (pool.alloc())CBD(update_destroyed, "a");
+	CBD *b = new (pool.alloc())CBD(update_destroyed, "b");
+	new (pool.alloc())CBD(update_destroyed, "c");
+
+	pool.mark(b);
+	ASSERT_EQ(0, pool.sweep());
+	ASSERT_EQ(Set(), destoyed);
+
+	new (pool.alloc())CBD(update_destroyed, "d");
+	ASSERT_EQ(Set({"a", "c"}), destoyed);
+	ASSERT_EQ(2, pool.num_allocated());
+
+	pool.sweep();
+	ASSERT_EQ(2, pool.finish_sweep());
+	ASSERT_EQ(Set({"a", "b", "c", "d"}), destoyed);
+}
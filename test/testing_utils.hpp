@@ -27,4 +27,25 @@ void run_code(atl::TinyVM& vm, atl::Code& code)
 	code.code.pop_back();
 }
 
+/** Count how many times `instruction` appears in code, starting from
+ * `begin`.  Words which are pushed as data don't count.
+ */
+size_t count_instruction(atl::Code const& code,
+                         atl::tag_t instruction,
+                         size_t begin=0)
+{
+	using namespace atl;
+	size_t count = 0;
+
+	for(auto pos = begin; pos < code.size(); ++pos)
+		{
+			if(code.code[pos] == instruction)
+				{ ++count; }
+
+			if(code.code[pos] == vm_codes::Tag<vm_codes::push>::value)
+				{ ++pos; }
+		}
+	return count;
+}
+
 #endif
@@ -34,7 +34,7 @@ TEST(TestBasic, test_marking_WResult)
 	{
 		auto result = alloc_stuff();
 
-		ASSERT_EQ(*result.subs.manage_marking.itr,
+		ASSERT_EQ(result.subs.manage_marking.container,
 		          dynamic_cast<MarkBase*>(&result.subs));
 
 		ASSERT_EQ(2, gc.cells_allocated());
@@ -63,12 +63,12 @@ TEST_F(TestSubstitution, test_move_SubstituteMap)
 	SubstituteMap subs0(gc);
 
 	ASSERT_EQ(1, gc._mark_bases.size());
-	ASSERT_EQ(gc._mark_bases.begin(), subs0.manage_marking.itr);
+	ASSERT_EQ(gc._mark_bases.head, &subs0.manage_marking);
 
 	SubstituteMap subs1(std::move(subs0));
 	ASSERT_EQ(1, gc._mark_bases.size());
-	ASSERT_EQ(gc._mark_bases.begin(), subs1.manage_marking.itr);
-	ASSERT_EQ(*subs1.manage_marking.itr,
+	ASSERT_EQ(gc._mark_bases.head, &subs1.manage_marking);
+	ASSERT_EQ(gc._mark_bases.head->container,
 	          dynamic_cast<MarkBase*>(&subs1));
 
 	ASSERT_EQ(nullptr, subs0.manage_marking.gc);
@@ -302,3 +302,39 @@ TEST_F(VmTest, test_define_constant)
 
 	ASSERT_EQ(vm.stack[0], 3);
 }
+
+/* Closures are kept by the words in root ranges (by their start or,
+ * like a frame, their captured values) and by the closures they're
+ * captured in. */
+TEST(ClosurePoolTest, test_collect)
+{
+	ClosurePool pool;
+	pcode::value_type roots[2];
+
+	auto inner = pool.closure(1, 0, 1);
+	auto outer = pool.closure(2, 1, 1);
+	auto framed = pool.closure(3, 0, 2);
+	pool.closure(4, 0, 0);
+
+	inner[2] = 7;
+	outer[2] = reinterpret_cast<pcode::value_type>(inner);
+	framed[2] = 9;
+
+	roots[0] = reinterpret_cast<pcode::value_type>(outer);
+	roots[1] = reinterpret_cast<pcode::value_type>(framed + 2);
+
+	auto root = pool.add_root([&](ClosurePool& closures)
+	                          { closures.mark_range(roots, roots + 2); });
+
+	ASSERT_EQ(4, pool.num_closures());
+	ASSERT_EQ(1, pool.collect());
+	ASSERT_EQ(3, pool.num_closures());
+	ASSERT_EQ(7, inner[2]);
+	ASSERT_EQ(9, framed[2]);
+
+	roots[0] = roots[1] = 0;
+	ASSERT_EQ(3, pool.collect());
+	ASSERT_EQ(0, pool.num_closures());
+
+	pool.remove_root(root);
+}
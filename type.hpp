@@ -626,10 +626,17 @@ namespace atl
 
 	    pcode::Offset body_address;
 
+	    // Set to keep the compiler from inlining calls to this function.
+	    bool noinline;
+
+	    // The body, kept when the compiler leaves it to be compiled
+	    // on the first call.
+	    Any lazy_body;
+
 	    LambdaMetadata()=delete;
 
 	    LambdaMetadata(Ast formals_)
-		    : formals(formals_)
+		    : formals(formals_), noinline(false), lazy_body(tag<Null>::value, nullptr)
 	    {}
 
 	    ClosureParameter new_closure_parameter(std::string const& name,
@@ -679,11 +686,21 @@ namespace atl
 	    size_t arity;
 	    bool variadic;
 
+	    // A pure function's result depends only on its arguments and
+	    // it has no side effects, so it can be evaluated at compile
+	    // time.
+	    bool pure;
+
+	    // A VM instruction which does the same thing as `fn` when
+	    // the arguments are Fixnums, or 0 if there isn't one.
+	    tag_t native_instruction;
+
 	    CxxFunctor(const Fn& fn
 	               , const std::string& name
 	               , Ast const& tt
 	               , size_t arity_)
-		    : name(name), fn(fn), type(tt), arity(arity_), variadic(false)
+		    : name(name), fn(fn), type(tt), arity(arity_), variadic(false), pure(false)
+		    , native_instruction(0)
 	    {}
     };
 
@@ -11,6 +11,7 @@
 #include "./helpers.hpp"
 #include "./helpers/pattern_match.hpp"
 
+#include <map>
 #include <unordered_map>
 #include <vector>
 #include <functional>
@@ -359,8 +360,8 @@ namespace atl
 			        return rval;
 		        }
 
-	        Marked<Ast> left_ast{gc._cxx_stack, left};
-	        Marked<Ast> right_ast{gc._cxx_stack, right};
+	        Marked<Ast> left_ast{gc._handles, left};
+	        Marked<Ast> right_ast{gc._handles, right};
 
 	        while(true)
 	            {
@@ -489,6 +490,54 @@ namespace atl
 		    return rval;
 	    }
 
+	    /// Are `left` and `right` the same type, up to the names
+	    /// of their quantified variables?
+	    bool same_scheme(Scheme const& left, Scheme const& right)
+	    {
+		    std::map<Type::value_type, Type::value_type> renamed, renamed_back;
+
+		    std::function<bool (Any, Any)> same = [&](Any ll, Any rr)
+			    {
+				    if(ll._tag != rr._tag)
+					    { return false; }
+
+				    switch(ll._tag)
+					    {
+					    case tag<Type>::value:
+						    {
+							    auto lt = unwrap<Type>(ll), rt = unwrap<Type>(rr);
+							    auto lv = lt.value(), rv = rt.value();
+
+							    if(lt.is_rigid() != rt.is_rigid())
+								    { return false; }
+
+							    if(lv < LAST_CONCRETE_TYPE || rv < LAST_CONCRETE_TYPE
+							       || !left.quantified.count(lv) || !right.quantified.count(rv))
+								    { return lv == rv; }
+
+							    auto forward = renamed.emplace(lv, rv);
+							    auto back = renamed_back.emplace(rv, lv);
+							    return forward.first->second == rv && back.first->second == lv;
+						    }
+					    case tag<Ast>::value:
+						    {
+							    auto la = unwrap<Ast>(ll), ra = unwrap<Ast>(rr);
+							    auto litr = la.begin(), ritr = ra.begin();
+							    for(; litr != la.end() && ritr != ra.end(); ++litr, ++ritr)
+								    {
+									    if(!same(*litr, *ritr))
+										    { return false; }
+								    }
+							    return litr == la.end() && ritr == ra.end();
+						    }
+					    default:
+						    return ll.value == rr.value;
+					    }
+			    };
+
+		    return same(left.type, right.type);
+	    }
+
 	    // WResult is meant to mark its members on a recieving
 	    // function, but not on the returning function (similar to the
 	    // logic for MarkedBase; see the comments there for an attempt
@@ -525,6 +574,11 @@ namespace atl
 		    Type::value_type& new_types;
 		    Gamma& gamma;
 
+		    // Lambdas enclosing the expression being inferred, so
+		    // Parameters and ClosureParameters can be typed by the
+		    // formals they refer to.  Entries may be null.
+		    std::vector<LambdaMetadata*> _lambdas;
+
 		    AlgorithmW(GC& gc_, Type::value_type& new_types_, Gamma& gamma_)
 			    : gc(gc_),
 			      new_types(new_types_),
@@ -548,6 +602,33 @@ namespace atl
 			    return sym;
 		    }
 
+		    /// Find Gamma's entry for the variable a Parameter or
+		    /// ClosureParameter of the innermost lambda refers to.
+		    Gamma::SymMap::iterator _bound_variable(Any const& var)
+		    {
+			    if(_lambdas.empty() || !_lambdas.back())
+				    { return gamma.symbols.end(); }
+
+			    auto& metadata = *_lambdas.back();
+
+			    if(is<Parameter>(var))
+				    {
+					    auto idx = unwrap<Parameter>(var).value;
+					    if(idx >= metadata.formals.size())
+						    { return gamma.symbols.end(); }
+
+					    return gamma.symbols.find(unwrap<Symbol>(metadata.formals[idx]).name);
+				    }
+
+			    auto idx = unwrap<ClosureParameter>(var).value;
+			    for(auto& item : metadata.closure_index_map)
+				    {
+					    if(item.second == idx)
+						    { return gamma.symbols.find(item.first); }
+				    }
+			    return gamma.symbols.end();
+		    }
+
 		    WResult W(Ast::Subex subex)
 		    {
 			    auto itr = subex.begin();
@@ -557,6 +638,8 @@ namespace atl
 					    if(subex.size() != 3)
 						    { throw ArityError("Lambda accepts only a formals and body lists"); }
 
+					    auto metadata = unwrap<Lambda>(*itr).value;
+
 					    ++itr;
 					    auto formals = atl::subex(itr);
 
@@ -565,7 +648,16 @@ namespace atl
 					    WResult body = WResult(SubstituteMap(gc), gc.marked(wrap<Null>()));
 					    {
 						    FormalsScope scope(gamma, new_types, formals);
-						    body = W(itr);
+
+						    _lambdas.push_back(metadata);
+						    try
+							    { body = W(itr); }
+						    catch(...)
+							    {
+								    _lambdas.pop_back();
+								    throw;
+							    }
+						    _lambdas.pop_back();
 					    }
 
 					    if(formals.empty())
@@ -609,9 +701,6 @@ namespace atl
 					    ++itr;
 					    auto& sym = get_sym(unwrap<Symbol>(itr.reference()));
 
-					    if(gamma.symbols.count(sym.name))
-						    { throw RedefinitionError("Can't redefine a symbol at the same scope."); }
-
 					    ++itr;
 					    auto e1 = W(itr);
 
@@ -624,6 +713,17 @@ namespace atl
 
 					    sym.scheme = generalize(generalize_env, *e1.type);
 
+					    // Code compiled against the old definition
+					    // depends on its type
+					    auto previous = gamma.symbols.find(sym.name);
+					    if(previous != gamma.symbols.end()
+					       && !same_scheme(previous->second, sym.scheme))
+						    {
+							    throw RedefinitionError
+								    (std::string("Can't redefine ").append(sym.name)
+								     .append(" with a different type."));
+						    }
+
 					    gamma.symbols[sym.name] = sym.scheme;
 					    return WResult(std::move(e1.subs), gc.marked(wrap(&sym.scheme)));
 				    }
@@ -709,6 +809,19 @@ namespace atl
 				    case tag<Type>::value:
 					    return WResult(SubstituteMap(gc), gc.marked(*itr));
 
+				    case tag<Parameter>::value:
+				    case tag<ClosureParameter>::value:
+					    {
+						    auto found = _bound_variable(*itr);
+						    if(found != gamma.symbols.end())
+							    {
+								    return WResult(SubstituteMap(gc),
+								                   gc.marked(found->second.type));
+							    }
+						    return WResult(SubstituteMap(gc),
+						                   gc.marked(wrap<Type>(itr->_tag)));
+					    }
+
 				    default:
 					    {
 						    auto found = gamma.types.find(itr->_tag);
@@ -728,11 +841,19 @@ namespace atl
 				    }
 		    }
 
+		    // W makes a lot of short lived Marked handles; the
+		    // HandleScope tidies up the ones released out of order.
 		    WResult W(Ast& ast)
-		    { return W(ast.subex()); }
+		    {
+			    GC::HandleScope scope(gc);
+			    return W(ast.subex());
+		    }
 
 		    WResult W(Marked<Ast>& ast)
-		    { return W(ast->subex()); }
+		    {
+			    GC::HandleScope scope(gc);
+			    return W(ast->subex());
+		    }
 	    };
     }
 }
@@ -11,6 +11,7 @@
 #include <map>
 #include <string>
 #include <vector>
+#include <functional>
 
 #include <boost/preprocessor/seq/enum.hpp>
 #include <boost/preprocessor/seq/for_each.hpp>
@@ -46,6 +47,7 @@ namespace atl
 
 		CodeBacker const* code;	// just the byte code
 		value_type* slots;
+		size_t num_slots;
 
 		vm_stack::Offset pc;
 		iterator top;           // 1 past last value
@@ -53,7 +55,17 @@ namespace atl
 
 		value_type stack[stack_size]; // the function argument and adress stack
 
+		// Compiles the body of a function whose code was left as a
+		// lazy_compile stub (at the given address), returning where
+		// the body starts.
+		typedef std::function<pcode::Offset (LambdaMetadata*, pcode::Offset)> CompileLazily;
+		CompileLazily compile_lazily;
+
+		// Marks the closures on the stack and in the slots
+		size_t _closure_root;
+
 		TinyVM()=delete;
+		TinyVM(TinyVM const&)=delete;
 
 		void _reset_stack()
 		{
@@ -64,10 +76,23 @@ namespace atl
 
 		TinyVM(GC& gc)
 			: _gc(gc),
-			  slots(nullptr)
-		{ _reset_stack(); }
+			  slots(nullptr),
+			  num_slots(0)
+		{
+			_reset_stack();
+			_closure_root = _gc.add_closure_root
+				([this](ClosurePool& closures)
+				 {
+					 closures.mark_range(stack, top);
+					 closures.mark_range(slots, slots + num_slots);
+				 });
+		}
 
-		~TinyVM() { if(slots) { delete []slots; } }
+		~TinyVM()
+		{
+			_gc.remove_closure_root(_closure_root);
+			if(slots) { delete []slots; }
+		}
 
 		value_type back() { return *(top - 1); }
 
@@ -168,6 +193,34 @@ namespace atl
 			pc = closure->body;
 		}
 
+		/** Call code which doesn't need a closure (eg a lifted
+		 * lambda, whose captured variables are passed as extra
+		 * arguments).
+		 *
+		 * Pre call stack:
+		 *   [arg1]...[argN][N][address]
+		 *                             ^- top
+		 * Post call:
+		 *   [arg1]...[argN][old-call-stack][N][return-address][null]
+		 *                  ^                                   top -^
+		 *                  ^- call_stack
+		 */
+		void call_procedure()
+		{
+			top -= 2;
+			auto address = top[1];
+			auto num_args = top[0];
+
+			*top = reinterpret_cast<value_type>(call_stack);
+			call_stack = top;
+			call_stack[1] = num_args;
+			call_stack[2] = reinterpret_cast<value_type>(pc + 1);
+			call_stack[3] = 0;
+
+			top = call_stack + 4;
+			pc = address;
+		}
+
 		/**
 		 * Pre call stack:
 		 *   [body-addr][capture-arg1]...[capture-argN][formals-count][capture-count]
@@ -197,6 +250,30 @@ namespace atl
 			++pc;
 		}
 
+		/// \internal Replace the top two words (both Fixnums) with
+		/// `op` of them.
+		template<class Op>
+		void _fixnum_op(Op op)
+		{
+			--top;
+			top[-1] = static_cast<value_type>
+				(op(static_cast<long>(top[-1]), static_cast<long>(top[0])));
+			++pc;
+		}
+
+		/* Fixnum arithmetic the compiler uses in place of calling the
+		 * matching primitives through std_function.
+		 * pre: [a][b]<- top
+		 * post: [a op b]<- top
+		 */
+		void fixnum_add() { _fixnum_op(std::plus<long>()); }
+		void fixnum_sub() { _fixnum_op(std::minus<long>()); }
+		void fixnum_eq() { _fixnum_op(std::equal_to<long>()); }
+		void fixnum_lt() { _fixnum_op(std::less<long>()); }
+		void fixnum_gt() { _fixnum_op(std::greater<long>()); }
+		void fixnum_le() { _fixnum_op(std::less_equal<long>()); }
+		void fixnum_ge() { _fixnum_op(std::greater_equal<long>()); }
+
 		/** Gets the `arg-offset` value from this frame's closure.
 		 * pre: [arg-offset]<- top
 		 * post: [value]<-top
@@ -254,9 +331,57 @@ namespace atl
 			++top;
 		}
 
+		/** Get a value computed earlier in the current frame, counting
+		 * from the frame's first free word.
+		 * pre: [depth]<- top
+		 * post: [value]<- top
+		 */
+		void local()
+		{
+			auto base = call_stack ? call_stack + 4 : stack;
+			*(top - 1) = base[*(top - 1)];
+			++pc;
+		}
+
+		/** Drop the N words under the top value.
+		 * pre: [word1]...[wordN][value][N]<- top
+		 * post: [value]<- top
+		 */
+		void slide()
+		{
+			auto words = *(top - 1);
+			auto value = *(top - 2);
+			top -= words + 1;
+			*(top - 1) = value;
+			++pc;
+		}
+
+		/** Compile the body of the function being entered and carry
+		 * on into it.  The stub ([push metadata][lazy_compile]) is the
+		 * function's entry point until compile_lazily patches it, so
+		 * this runs in the callee's frame.  The closure being called
+		 * is repointed at the compiled body.
+		 *
+		 * pre: [metadata]<- top
+		 * post: <- top
+		 */
+		void lazy_compile()
+		{
+			--top;
+			if(!compile_lazily)
+				{ throw BadPCodeInstruction("lazy_compile with no compiler attached"); }
+
+			auto body = compile_lazily(reinterpret_cast<LambdaMetadata*>(*top), pc - 2);
+
+			if(call_stack && call_stack[3])
+				{ reinterpret_cast<Closure*>(reinterpret_cast<iterator>(call_stack[3]) - 2)->body = body; }
+
+			pc = body;
+		}
+
 		/** Replace the current function's stack frame with arg0-argN
 		 * from the top of the stack, and re-use it when calling
-		 * `procedure-address`
+		 * `closure`.  The callee returns straight to our caller.
 		 *
 		 * Pre call stack:
 		 *
@@ -265,7 +390,7 @@ namespace atl
 		 *   [old-call-stack]	<- call_stack
 		 *   [caller's arg count]
 		 *   [return-address]
-		 *   ...
+		 *   [closure-vars]
 		 *   [my args...]
 		 *   [closure]
 		 *						<- top
@@ -280,26 +405,73 @@ namespace atl
 		 *                      <- top
 		 */
 		void tail_call()
+		{
+			auto closure = reinterpret_cast<Closure*>(*(top - 1));
+			_replace_frame(top - 1,
+			               closure->formals_count,
+			               reinterpret_cast<value_type>(closure->captured()),
+			               closure->body);
+		}
+
+		/** call_procedure from tail position; see tail_call.
+		 *
+		 * Pre call stack:
+		 *   [caller's frame]...[arg1]...[argN][N][address]
+		 *                                                ^- top
+		 */
+		void tail_procedure()
+		{ _replace_frame(top - 2, top[-2], 0, top[-1]); }
+
+		/// \internal Move the `num_args` values ending at `args_end`
+		/// over the current frame's arguments and set up the frame to
+		/// run `body` in place of the current function.
+		void _replace_frame(iterator args_end,
+		                    value_type num_args,
+		                    value_type captured,
+		                    value_type body)
 		{
 			auto enclosing_frame = call_stack[0];
 			auto enclosing_arg_count = call_stack[1];
 			auto pc_continue = call_stack[2];
 
-			auto closure = reinterpret_cast<Closure*>(*(top - 1));
-
-			call_stack -= enclosing_arg_count;
-			for(auto iitr = top - closure->formals_count - 1;
-			    iitr != top;
-			    ++iitr, ++call_stack)
-				{ *call_stack = *iitr; }
+			// the new args are always above the old frame, so a
+			// forward copy is safe
+			auto out = call_stack - enclosing_arg_count;
+			for(auto iitr = args_end - num_args; iitr != args_end; ++iitr, ++out)
+				{ *out = *iitr; }
 
-			*call_stack = closure->formals_count;
+			call_stack = out;
 			call_stack[0] = enclosing_frame;
-			call_stack[1] = pc_continue;
-			call_stack[2] = reinterpret_cast<value_type>(closure->captured());
+			call_stack[1] = num_args;
+			call_stack[2] = pc_continue;
+			call_stack[3] = captured;
 
-			top = call_stack + 3;
-			pc = closure->body;
+			top = call_stack + 4;
+			pc = body;
+		}
+
+		/** Overwrite the current frame's arguments with the same
+		 * number of values from the top of the stack, leaving the rest
+		 * of the frame as is.  Used to turn a self tail call into a
+		 * jump.
+		 *
+		 * Pre call stack:
+		 *   [arg1]...[argN][old-call-stack][N][return-address][closure-vars]...[new-arg1]...[new-argN]
+		 *                  ^- call_stack                                                      top -^
+		 * Post call stack:
+		 *   [new-arg1]...[new-argN][old-call-stack][N][return-address][closure-vars]
+		 *                          ^- call_stack                                top -^
+		 */
+		void rebind_args()
+		{
+			auto num_args = call_stack[1];
+
+			auto out = call_stack - num_args;
+			for(auto iitr = top - num_args; iitr != top; ++iitr, ++out)
+				{ *out = *iitr; }
+
+			top = call_stack + 4;
+			++pc;
 		}
 
 		bool step(CodeBacker const& code)
@@ -329,7 +501,8 @@ namespace atl
 		void enter_code(Code const& input)
 		{
 			if(slots) { delete []slots; }
-			slots = new value_type[input.num_slots];
+			num_slots = input.num_slots;
+			slots = new value_type[num_slots]();
 			_reset_stack();
 		}
 